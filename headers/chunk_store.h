@@ -0,0 +1,54 @@
+#ifndef CN_CHUNK_STORE_H
+#define CN_CHUNK_STORE_H
+#include "common.h"
+#include <stdio.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Chunks kept on disk by their hash, whatever file they came from, each in
+// its own file under a directory named after its first byte. The index is a
+// journal of fixed size records, each giving a chunk its size and the time it
+// was last used, or removing it with a size of 0; it is replayed when the
+// store is opened and rewritten once it is mostly stale records. Chunk files
+// are renamed into place before they are recorded, and the ones the index
+// does not know about are removed when the store is opened. The least
+// recently used chunks are evicted to keep the store within its quota.
+// Safe to use from several threads at once.
+class ChunkStore {
+    struct Entry {
+        uint32_t size;
+        uint64_t last_used;
+    };
+    std::string dir;
+    size_t quota;
+    size_t total;
+    uint64_t clock;
+    size_t records;
+    size_t tmp_files;
+    std::unordered_map<hash_t, Entry> entries;
+    std::map<uint64_t, hash_t> by_use;
+    FILE* journal;
+    std::mutex mutex;
+    std::string chunk_path(const hash_t& hash) const;
+    void load();
+    void remove_unknown_files();
+    void compact();
+    void record(const hash_t& hash, uint32_t size, uint64_t last_used);
+    void touch(const hash_t& hash, Entry& entry);
+    void evict(const hash_t& hash);
+public:
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+    ChunkStore(const std::string& dir, size_t quota);
+    ~ChunkStore();
+    // Reads the chunk into destination, which the caller has to verify, and
+    // marks it as used. Fails if the chunk is not stored with that size.
+    bool get(const hash_t& hash, uint8_t* destination, size_t size);
+    // Stores the chunk, or only marks it as used if it already is.
+    void put(const hash_t& hash, const Chunk& chunk);
+    // Drops a chunk that did not read back as stored.
+    void discard(const hash_t& hash);
+};
+#endif
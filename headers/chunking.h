@@ -0,0 +1,41 @@
+#ifndef CN_CHUNKING_H
+#define CN_CHUNKING_H
+#include "common.h"
+#include <vector>
+
+// Fixed chunking cuts a file every max_size bytes. Content-defined chunking
+// cuts where a gear hash of the 64 bytes before a position hits a mask, at
+// least min_size and at most max_size bytes after the previous cut, so that
+// the cuts after an inserted or removed range stay where they were in the
+// content. Up to avg_size bytes a harder mask is used, past it an easier one,
+// which keeps most chunks close to avg_size.
+enum chunking_mode: uint8_t {
+    fixed_chunking,
+    content_defined_chunking
+};
+
+struct Chunking {
+    chunking_mode mode;
+    uint32_t min_size;
+    uint32_t avg_size;
+    uint32_t max_size;
+    Chunking(): mode(fixed_chunking), min_size(chunk_max_size), avg_size(chunk_max_size), max_size(chunk_max_size) {}
+    Chunking(chunking_mode mode, uint32_t min_size, uint32_t avg_size, uint32_t max_size):
+        mode(mode), min_size(min_size), avg_size(avg_size), max_size(max_size) {}
+    bool valid() const;
+};
+
+// The chunking of a file of file_size bytes with chunks of about chunk_size
+// bytes; content-defined chunks are then a quarter to four times that. With
+// chunk_size 0 the size is picked for the file: the power of two that gives
+// it about target_file_chunks chunks, within min_picked_chunk_size and
+// max_picked_chunk_size, so that big images do not weigh on the scheduler
+// with too many chunks and small files are not sent as a single one. Below
+// the minimum, the work done per chunk by the server and the peers costs
+// more than the finer chunks gain once several clients share a file.
+Chunking pick_chunking(chunking_mode mode, size_t chunk_size, uint64_t file_size);
+
+// The sizes of the chunks size bytes of data are cut into. Fixed chunking
+// does not look at the data, which may then be null.
+std::vector<uint32_t> cut_chunks(const uint8_t* data, size_t size, const Chunking& chunking);
+#endif
@@ -1,162 +1,757 @@
 #ifndef CN_CLIENT_H
 #define CN_CLIENT_H
+#include <algorithm>
 #include <string>
 #include "file.h"
+#include "chunk_store.h"
+#include "hash.h"
 #include "ui.h"
 #include "communication.h"
+#include "compression.h"
+#include "multicast.h"
+#include "thread_pool.h"
 #include "common.h"
+#include <string.h>
+#include <memory>
 #include <utility>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 using namespace boost::asio::ip;
 
+// A chunk being put together from multicast fragments, in place at its
+// first position.
+struct MulticastChunk {
+    std::vector<File*> targets;
+    uint8_t* destination;
+    size_t size;
+    std::vector<bool> received;
+    size_t remaining;
+    MulticastChunk(const std::vector<File*>& targets, uint8_t* destination, size_t size):
+        targets(targets), destination(destination), size(size),
+        received((size + multicast_fragment_size - 1) / multicast_fragment_size),
+        remaining(received.size()) {}
+};
+
 template<class UI = DefaultUI>
 class Client {
     std::string base_folder;
     std::unordered_map<std::string, File> files;
     address server_ip;
     std::unordered_map<hash_t, std::vector<File*>> chunk_files;
-    std::unordered_map<address, tcp::socket> client_sockets;
+    // Peer addresses by the ids the server names them with, and idle
+    // connections to them.
+    std::vector<address> peers;
+    std::unordered_multimap<uint32_t, tcp::socket> client_sockets;
     std::unordered_set<hash_t> present_chunks;
+    std::unordered_set<hash_t> receiving_chunks;
+    // Copies of chunks that arrived whole while another copy was still being
+    // received, as they were encoded, taken over if that one fails.
+    std::unordered_map<hash_t, std::pair<chunk_encoding, std::shared_ptr<std::vector<uint8_t>>>> spare_chunks;
+    std::vector<hash_t> acquired_chunks;
+    std::unordered_map<std::string, std::vector<hash_t>> file_chunks;
+    std::unordered_map<hash_t, MulticastChunk> multicast_chunks;
+    std::unordered_map<std::string, uint32_t> nacked_rounds;
     std::vector<std::string> files_to_get;
+    size_t upload_slots;
+    size_t download_slots;
+    size_t io_threads;
+    bool compress;
+    CompressionCache compression_cache;
+    address multicast_group;
+    // Chunks kept from the files fetched before, if there is a store.
+    std::unique_ptr<ChunkStore> store;
+    // Guards everything above and the UI for the io threads and the chunk
+    // verification callbacks. Recursive, as spawn may start a coroutine
+    // inline on the thread that holds it.
+    std::recursive_mutex mutex;
     UI ui;
+    // Worker tasks that use the files or the store; run waits for them
+    // before it returns.
+    size_t background_tasks;
+    std::mutex background_mutex;
+    std::condition_variable background_done;
+    void post_background(std::function<void()> task);
     void run(bool forever);
+    size_t seed_file(File& file, const std::vector<hash_t>& chunks);
+    size_t add_file(const std::string& name, File&& added, const std::vector<hash_t>& chunks);
 public:
-    Client(const address& server_ip, const std::string& base_folder, const std::vector<std::string>& files_to_get):
-        base_folder(base_folder), server_ip(server_ip), files_to_get(files_to_get), ui({"Download status"}) {}
+    Client(const address& server_ip, const std::string& base_folder, const std::vector<std::string>& files_to_get,
+           size_t upload_slots = default_upload_slots, size_t download_slots = default_download_slots,
+           size_t io_threads = default_io_threads, bool compress = false, address multicast_group = address(),
+           const std::string& store_dir = "", size_t store_quota = default_store_quota):
+        base_folder(base_folder), server_ip(server_ip), files_to_get(files_to_get),
+        upload_slots(upload_slots), download_slots(download_slots), io_threads(io_threads),
+        compress(compress), compression_cache(compression_cache_size), multicast_group(multicast_group),
+        store(store_dir.empty() ? nullptr : new ChunkStore(store_dir, store_quota)),
+        ui({"Download status"}), background_tasks(0) {
+        // Each file is asked for once, as complete() counts them.
+        std::unordered_set<std::string> seen;
+        this->files_to_get.clear();
+        for (auto& x: files_to_get) {
+            if (seen.insert(x).second) this->files_to_get.push_back(x);
+        }
+    }
     void run_forever() {run(true);}
     void run_until_complete() {run(false);}
 };
 
+template<class UI>
+void Client<UI>::post_background(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(background_mutex);
+        background_tasks++;
+    }
+    ThreadPool::shared().post([this, task] () {
+        task();
+        std::lock_guard<std::mutex> lock(background_mutex);
+        if (--background_tasks == 0) background_done.notify_all();
+    });
+}
+
+// Fills the chunks a new file is missing from the other files and from the
+// store, and stores the ones it has in the background, so that they outlive
+// its old contents. Called without the mutex, before the file is added, as
+// nothing else writes to it until then. Chunks being received are left to
+// add_file or chunk_verified, whichever comes after they are verified.
+// Returns the number of bytes taken.
+template<class UI>
+size_t Client<UI>::seed_file(File& file, const std::vector<hash_t>& chunks) {
+    std::vector<hash_t> missing;
+    std::vector<File*> sources;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::unordered_set<hash_t> seen;
+        for (auto& x: chunks) {
+            if (!seen.insert(x).second || receiving_chunks.count(x)) continue;
+            if (file.get_present_chunks().count(x)) {
+                Chunk chunk = file.get_chunk_data(x);
+                if (store) post_background([this, x, chunk] () {store->put(x, chunk);});
+                continue;
+            }
+            File* source = nullptr;
+            auto it = chunk_files.find(x);
+            if (it != chunk_files.end()) {
+                for (auto y: it->second) {
+                    if (y->get_present_chunks().count(x)) source = y;
+                }
+            }
+            if (source || store) {
+                missing.push_back(x);
+                sources.push_back(source);
+            }
+        }
+    }
+    // Present chunks are never written to again, so the sources can be read
+    // while the io threads go on.
+    std::vector<char> taken(missing.size());
+    ThreadPool::shared().parallel_for(missing.size(), [&] (size_t i) {
+        const hash_t& hash = missing[i];
+        if (sources[i]) {
+            file.copy_chunk(sources[i]->get_chunk_data(hash), hash);
+            taken[i] = true;
+            return;
+        }
+        Chunk chunk(file.get_chunk_data(hash).size, file.get_chunk_destination(hash));
+        if (!store->get(hash, file.get_chunk_destination(hash), chunk.size)) return;
+        if (!(chunk.get_hash() == hash)) {
+            store->discard(hash);
+            return;
+        }
+        file.copy_chunk(chunk, hash);
+        taken[i] = true;
+    });
+    size_t bytes = 0;
+    for (size_t i=0; i<missing.size(); i++) {
+        if (!taken[i]) continue;
+        file.set_chunk_present(missing[i]);
+        bytes += file.get_chunk_data(missing[i]).size;
+    }
+    return bytes;
+}
+
+// Adds a hashed and seeded file to files and chunk_files. It gets the
+// chunks that were verified since seed_file skipped them, as they were
+// copied only into the files listed then; the ones still being received
+// reach it through chunk_verified. The other files get the chunks only the
+// new one had, as they count as present from now on. Those are claimed like
+// chunks being received and copied without the mutex, which the function
+// takes itself. Returns the number of bytes taken.
+template<class UI>
+size_t Client<UI>::add_file(const std::string& name, File&& added, const std::vector<hash_t>& chunks) {
+    File* file;
+    std::vector<hash_t> lent;
+    std::vector<std::vector<File*>> lent_targets;
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        file = &files.emplace(name, std::move(added)).first->second;
+        std::unordered_set<hash_t> needed_chunks(chunks.begin(), chunks.end());
+        for (auto& x: needed_chunks) {
+            chunk_files[x].push_back(file);
+        }
+        for (auto& x: needed_chunks) {
+            if (!file->get_present_chunks().count(x)) {
+                if (!present_chunks.count(x)) continue;
+                for (auto y: chunk_files.at(x)) {
+                    if (y == file || !y->get_present_chunks().count(x)) continue;
+                    file->copy_chunk(y->get_chunk_data(x), x);
+                    file->set_chunk_present(x);
+                    bytes += y->get_chunk_data(x).size;
+                    break;
+                }
+                continue;
+            }
+            if (present_chunks.count(x) || receiving_chunks.count(x)) continue;
+            lent.push_back(x);
+            lent_targets.emplace_back();
+            for (auto y: chunk_files.at(x)) {
+                if (y != file) lent_targets.back().push_back(y);
+            }
+            receiving_chunks.insert(x);
+            multicast_chunks.erase(x);
+        }
+    }
+    ThreadPool::shared().parallel_for(lent.size(), [&] (size_t i) {
+        Chunk chunk = file->get_chunk_data(lent[i]);
+        for (auto y: lent_targets[i]) y->copy_chunk(chunk, lent[i]);
+    });
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    for (size_t i=0; i<lent.size(); i++) {
+        receiving_chunks.erase(lent[i]);
+        spare_chunks.erase(lent[i]);
+        for (auto y: lent_targets[i]) y->set_chunk_present(lent[i]);
+        present_chunks.insert(lent[i]);
+    }
+    return bytes;
+}
+
 template<class UI>
 void Client<UI>::run(bool forever) {
     using namespace std::placeholders;
+    typedef std::lock_guard<std::recursive_mutex> lock_guard;
     boost::asio::io_service io_service;
     tcp::socket server_socket(io_service);
     boost::asio::io_service::strand server_strand(io_service);
 
-    auto chunk_data_sender = [this, &io_service] (SendChunkPacket packet, boost::asio::yield_context yield) {
+    auto complete = [this] () {
+        return files_to_get.size() == files.size() && chunk_files.size() == present_chunks.size();
+    };
+
+    // Everything sent to the server is queued and written by a single
+    // coroutine, as a write that yields could otherwise interleave with
+    // another one on the socket. Once the queue is empty, the chunks acquired
+    // meanwhile go out in one packet. A terminating client stops once it is
+    // complete and the last of them is out.
+    std::vector<EncodedPacket> server_queue;
+    bool server_writing = false;
+    auto server_writer = [this, forever, &server_socket, &io_service, &complete, &server_queue, &server_writing] (boost::asio::yield_context yield) {
+        for (;;) {
+            std::vector<EncodedPacket> packets;
+            {
+                lock_guard lock(mutex);
+                packets.swap(server_queue);
+                if (packets.empty() && !acquired_chunks.empty()) {
+                    packets.push_back(encode_packet(NewChunksPacket(acquired_chunks.begin(), acquired_chunks.end())));
+                    acquired_chunks.clear();
+                }
+                if (packets.empty()) {
+                    server_writing = false;
+                    if (!forever && complete()) io_service.stop();
+                    return;
+                }
+            }
+            try {
+                for (auto& x: packets) {
+                    send_packet(server_socket, yield, x);
+                }
+            } catch (const std::exception& e) {
+                lock_guard lock(mutex);
+                ui.log("Error sending to server: " + std::string(e.what()));
+            }
+        }
+    };
+
+    // Called with the mutex held.
+    auto start_server_writer = [&server_strand, &server_writer, &server_writing] () {
+        if (server_writing) return;
+        server_writing = true;
+        boost::asio::spawn(server_strand, server_writer);
+    };
+
+    // Called with the mutex held.
+    auto send_to_server = [&server_queue, &start_server_writer] (EncodedPacket packet) {
+        server_queue.push_back(packet);
+        start_server_writer();
+    };
+
+    // Whether the server knows about every chunk acquired so far. Called
+    // with the mutex held.
+    auto reported = [this, &server_queue, &server_writing] () {
+        return acquired_chunks.empty() && server_queue.empty() && !server_writing;
+    };
+
+    // Transfers given up on are reported, so that the server frees their
+    // slots and schedules the chunk again.
+    auto report_failure = [this, &send_to_server] (TransferFailedPacket packet) {
+        lock_guard lock(mutex);
+        send_to_server(encode_packet(packet));
+    };
+
+    // Every transfer in flight to a peer uses its own connection; idle ones
+    // are kept in client_sockets and reused by the next transfer.
+    auto chunk_data_sender = [this, &io_service, &report_failure] (SendChunkPacket packet, boost::asio::yield_context yield) {
+        Chunk chunk((size_t)0, nullptr);
+        address receiver;
+        {
+            lock_guard lock(mutex);
+            if (packet.receiver >= peers.size() || peers[packet.receiver].is_unspecified()) {
+                ui.log("Send packet: unknown peer " + std::to_string(packet.receiver));
+                report_failure(TransferFailedPacket(packet.chunk, packet.receiver));
+                return;
+            }
+            auto files = chunk_files.find(packet.chunk);
+            if (files == chunk_files.end() || files->second.empty()) {
+                ui.log("Send packet: unknown chunk requested");
+                report_failure(TransferFailedPacket(packet.chunk, packet.receiver));
+                return;
+            }
+            receiver = peers[packet.receiver];
+            chunk = files->second[0]->get_chunk_data(packet.chunk);
+        }
+        std::shared_ptr<const std::vector<uint8_t>> compressed;
+        if (compress) compressed = compression_cache.get(packet.chunk, chunk);
         for (size_t i=0; i<n_retries; i++) {
             try {
-                ChunkDataPacket output(chunk_files[packet.chunk][0]->get_chunk_data(packet.chunk));
-                if (!client_sockets.count(packet.receiver)) {
-                    client_sockets.emplace(
-                        std::piecewise_construct,
-                        std::forward_as_tuple(packet.receiver),
-                        std::forward_as_tuple(io_service));
-                    client_sockets.at(packet.receiver).async_connect(tcp::endpoint(packet.receiver, client_port), yield);
+                tcp::socket socket(io_service);
+                bool connected = false;
+                {
+                    lock_guard lock(mutex);
+                    auto idle = client_sockets.find(packet.receiver);
+                    if (idle != client_sockets.end()) {
+                        socket = std::move(idle->second);
+                        client_sockets.erase(idle);
+                        connected = true;
+                    }
+                }
+                if (!connected) socket.async_connect(tcp::endpoint(receiver, client_port), yield);
+                if (compressed) {
+                    send_packet(socket, yield, ChunkDataPacket(packet.chunk, chunk.size, Chunk(compressed->size(), compressed->data()), zlib, packet.relays));
+                } else {
+                    send_packet(socket, yield, ChunkDataPacket(packet.chunk, chunk, packet.relays));
                 }
-                send_packet(client_sockets.at(packet.receiver), yield, output);
-                break;
+                lock_guard lock(mutex);
+                if (peers[packet.receiver] == receiver) client_sockets.emplace(packet.receiver, std::move(socket));
+                return;
             } catch (const std::exception& e) {
+                lock_guard lock(mutex);
                 ui.log("Send packet: " + std::string(e.what()));
-                client_sockets.erase(packet.receiver);
             }
         }
+        report_failure(TransferFailedPacket(packet.chunk, packet.receiver));
     };
 
-    auto server_communication_handler = [this, &forever, &server_socket, &io_service, &chunk_data_sender] (boost::asio::yield_context yield) {
+    auto server_communication_handler = [this, &forever, &server_socket, &io_service, &chunk_data_sender, &complete, &reported, &send_to_server]
+                                         (boost::asio::yield_context yield) {
         try {
             server_socket.async_connect(tcp::endpoint(server_ip, server_port), yield);
-            for (auto& x: files_to_get) {
-                send_packet(server_socket, yield, GetFilePacket(x));
+            {
+                lock_guard lock(mutex);
+                send_to_server(encode_packet(SlotsPacket(upload_slots, download_slots)));
+                for (auto& x: files_to_get) {
+                    send_to_server(encode_packet(GetFilePacket(x)));
+                }
             }
+            PacketReader reader(server_socket);
             for (;;) {
-                packet_type type = get_packet_type(server_socket, yield);
+                packet_type type = reader.next(yield);
                 switch (type) {
                     case file_info: {
-                        FileInfoPacket packet(server_socket, yield);
-                        ui.log("Received file info (" + packet.name + ") from server!");
-                        files.emplace(
-                            std::piecewise_construct,
-                            std::forward_as_tuple(packet.name),
-                            std::forward_as_tuple(base_folder + "/" + packet.name, packet.size));
-                        files.at(packet.name).set_chunks_from_list(packet.chunk_list.chunks);
-                        std::unordered_set<hash_t> needed_chunks(packet.chunk_list.chunks.begin(), packet.chunk_list.chunks.end());
-                        for (auto& x: needed_chunks) {
-                            chunk_files[x].push_back(&files.at(packet.name));
+                        FileInfoPacket packet(reader);
+                        bool duplicate;
+                        {
+                            lock_guard lock(mutex);
+                            ui.log("Received file info (" + packet.name + ") from server!");
+                            duplicate = files.count(packet.name);
+                        }
+                        // A file asked for twice is set up once; the server
+                        // still waits for an answer to release us.
+                        if (duplicate) {
+                            lock_guard lock(mutex);
+                            send_to_server(encode_packet(ChunkListPacket(present_chunks.begin(), present_chunks.end())));
+                            break;
                         }
-                        for (auto& x: files.at(packet.name).get_present_chunks()) {
-                            present_chunks.insert(x);
+                        // Hashed and seeded before it is added, without
+                        // holding up the other io threads. Only this
+                        // coroutine adds files, so the name stays free.
+                        File file(base_folder + "/" + packet.name, packet.size);
+                        size_t reused = file.set_chunks_from_list(packet.chunk_list.chunks, packet.chunk_sizes, packet.chunking);
+                        size_t seeded = seed_file(file, packet.chunk_list.chunks);
+                        seeded += add_file(packet.name, std::move(file), packet.chunk_list.chunks);
+                        lock_guard lock(mutex);
+                        ui.log("Reused " + std::to_string(reused) + " bytes already in " + packet.name);
+                        if (seeded) ui.log("Took " + std::to_string(seeded) + " bytes of " + packet.name + " from other files and the chunk store");
+                        // Joining goes first, so that the server holds back
+                        // TCP transfers to us until the multicast is over.
+                        if (!multicast_group.is_unspecified()) {
+                            NackPacket join(packet.name, 0, packet.chunk_list.chunks.size());
+                            for (size_t i=0; i<packet.chunk_list.chunks.size(); i++) {
+                                if (!present_chunks.count(packet.chunk_list.chunks[i])) join.set_missing(i);
+                            }
+                            send_to_server(encode_packet(join));
+                        }
+                        send_to_server(encode_packet(ChunkListPacket(present_chunks.begin(), present_chunks.end())));
+                        file_chunks[packet.name] = std::move(packet.chunk_list.chunks);
+                        break;
+                    }
+                    case peer_info: {
+                        PeerInfoPacket packet(reader);
+                        lock_guard lock(mutex);
+                        if (peers.size() <= packet.id) peers.resize(packet.id+1);
+                        if (peers[packet.id] != packet.addr) {
+                            peers[packet.id] = packet.addr;
+                            client_sockets.erase(packet.id);
                         }
-                        send_packet(server_socket, yield, ChunkListPacket(present_chunks.begin(), present_chunks.end()));
                         break;
                     }
                     case send_chunk: {
-                        boost::asio::spawn(io_service, std::bind(chunk_data_sender, SendChunkPacket(server_socket, yield), _1));
+                        boost::asio::spawn(io_service, std::bind(chunk_data_sender, SendChunkPacket(reader), _1));
                         break;
                     }
                     case error: {
-                        ui.log("Received error from server: " + ErrorPacket(server_socket, yield).get_as_string());
+                        std::string message = ErrorPacket(reader).get_as_string();
+                        lock_guard lock(mutex);
+                        ui.log("Received error from server: " + message);
                         break;
                     }
                     default: {
+                        lock_guard lock(mutex);
                         ui.log("Unknown packet type from server: " + std::to_string(type));
-                        ErrorPacket answer(unknown_packet);
-                        send_packet(server_socket, yield, answer);
+                        send_to_server(encode_packet(ErrorPacket(unknown_packet)));
                     }
                 }
+                lock_guard lock(mutex);
                 ui.report_status(files);
                 if (forever) continue;
-                if (files_to_get.size() == files.size() && chunk_files.size() == present_chunks.size()) {
-                    io_service.stop();
+                // Otherwise server_writer stops once it is done.
+                if (complete()) {
+                    if (reported()) io_service.stop();
                     break;
                 }
             }
         } catch (const std::exception& e) {
+            lock_guard lock(mutex);
             ui.log("Server communication: " + std::string(e.what()));
         }
     };
 
-    auto new_chunk_sender = [this, &server_socket] (const hash_t& hash, boost::asio::yield_context yield) {
+    // Acquired chunks are reported to the server right away while fewer
+    // chunks than download_slots are being received, as the server can only
+    // fill a free slot once it knows about it. In bursts, when more chunks
+    // arrive at once, they are batched, and sent when new_chunks_batch of
+    // them are waiting, new_chunks_delay_ms after the first one, or when the
+    // download is complete.
+    boost::asio::steady_timer flush_timer(io_service);
+    bool flush_timer_armed = false;
+
+    // Called with the mutex held.
+    auto flush_new_chunks = [&flush_timer, &flush_timer_armed, &start_server_writer] () {
+        if (flush_timer_armed) flush_timer.cancel();
+        flush_timer_armed = false;
+        start_server_writer();
+    };
+
+    // Runs on an io thread once a worker has checked a received chunk.
+    // Only the targets were filled by the worker; files added since the
+    // chunk was claimed get their copy here.
+    auto chunk_verified = [this, &flush_timer, &flush_timer_armed, &complete, &flush_new_chunks, &report_failure]
+                          (const hash_t& hash, const std::vector<File*>& targets, Chunk chunk, bool valid) {
+        lock_guard lock(mutex);
+        receiving_chunks.erase(hash);
+        spare_chunks.erase(hash);
+        if (!valid) {
+            ui.log("Corrupted chunk received!");
+            report_failure(TransferFailedPacket(hash));
+            return;
+        }
+        for (auto x: chunk_files.at(hash)) {
+            if (std::find(targets.begin(), targets.end(), x) == targets.end()) x->copy_chunk(chunk, hash);
+            x->set_chunk_present(hash);
+        }
+        present_chunks.insert(hash);
+        acquired_chunks.push_back(hash);
+        ui.report_status(files);
+        if (receiving_chunks.size() < download_slots || acquired_chunks.size() >= new_chunks_batch || complete()) {
+            flush_new_chunks();
+        } else if (!flush_timer_armed) {
+            flush_timer_armed = true;
+            flush_timer.expires_after(std::chrono::milliseconds(new_chunks_delay_ms));
+            flush_timer.async_wait([this, &flush_timer_armed, &flush_new_chunks] (const boost::system::error_code& ec) {
+                if (ec) return;
+                lock_guard lock(mutex);
+                if (!flush_timer_armed) return;
+                flush_new_chunks();
+            });
+        }
+    };
+
+    // Checks a received chunk on a worker, after decoding it into place if
+    // it arrived encoded, and copies it to the chunk's other positions and to
+    // the store. A chunk that was hashed while it arrived is only copied.
+    auto verify_chunk = [this, &io_service, &chunk_verified] (const hash_t& hash, const std::vector<File*>& targets, uint8_t* destination,
+                                                              size_t size, std::shared_ptr<std::vector<uint8_t>> encoded, bool hashed) {
+        Chunk chunk(size, destination);
+        post_background([this, &io_service, &chunk_verified, chunk, destination, encoded, hash, targets, hashed] () {
+            bool valid = hashed;
+            if (!valid) {
+                valid = !encoded || decompress_chunk(Chunk(encoded->size(), encoded->data()), destination, chunk.size);
+                valid = valid && chunk.get_hash() == hash;
+            }
+            if (valid) {
+                for (auto x: targets) x->copy_chunk(chunk, hash);
+                if (store) store->put(hash, chunk);
+            }
+            io_service.post(std::bind(chunk_verified, hash, targets, chunk, valid));
+        });
+    };
+
+    // Verifies a copy of a chunk that was read aside, once it may go to its
+    // positions. Called with the mutex held.
+    auto verify_copy = [&verify_chunk] (const hash_t& hash, const std::vector<File*>& targets, uint8_t* destination, size_t size,
+                                        chunk_encoding encoding, std::shared_ptr<std::vector<uint8_t>> copy) {
+        if (encoding == raw) {
+            memcpy(destination, copy->data(), size);
+            copy.reset();
+        }
+        verify_chunk(hash, targets, destination, size, copy, false);
+    };
+
+    // Connects to the next peer of a relay chain and sends it the frame of
+    // the chunk; the payload frames follow as they arrive.
+    auto open_relay = [this] (const ChunkDataPacket& packet, tcp::socket& next, address& next_addr, boost::asio::yield_context yield) {
+        uint32_t next_id = packet.relays.peers[0];
+        bool connected = false;
+        {
+            lock_guard lock(mutex);
+            if (next_id >= peers.size() || peers[next_id].is_unspecified()) {
+                ui.log("Relay: unknown peer " + std::to_string(next_id));
+                return false;
+            }
+            next_addr = peers[next_id];
+            auto idle = client_sockets.find(next_id);
+            if (idle != client_sockets.end()) {
+                next = std::move(idle->second);
+                client_sockets.erase(idle);
+                connected = true;
+            }
+        }
         try {
-            send_packet(server_socket, yield, NewChunkPacket(hash));
+            if (!connected) next.async_connect(tcp::endpoint(next_addr, client_port), yield);
+            RelayList rest(packet.relays.peers.begin()+1, packet.relays.peers.end());
+            send_header(next, yield, ChunkDataPacket(packet.hash, packet.size, Chunk(packet.chunk.size, nullptr), packet.encoding, rest));
+            return true;
         } catch (const std::exception& e) {
-            ui.log("Error sending update to server: " + std::string(e.what()));
+            lock_guard lock(mutex);
+            ui.log("Relay: " + std::string(e.what()));
+            return false;
         }
     };
 
-    auto peer_connect_handler = [this, forever, &server_strand, &io_service, &new_chunk_sender] (tcp::socket& socket, boost::asio::yield_context yield) {
+    auto peer_connect_handler = [this, &io_service, &verify_chunk, &verify_copy, &open_relay, &report_failure] (tcp::socket& socket, boost::asio::yield_context yield) {
         try {
+            PacketReader reader(socket);
             for (;;) {
-                packet_type type = get_packet_type(socket, yield);
+                packet_type type = reader.next(yield);
                 switch (type) {
                     case chunk_data: {
-                        ChunkDataPacket packet(socket, yield);
-                        const hash_t& hash = packet.get_chunk().get_hash();
-                        if (!chunk_files.count(hash)) {
-                            ui.log("Unknown chunk received!");
-                            break;
+                        ChunkDataPacket packet(reader);
+                        const hash_t hash = packet.hash;
+                        // Checked before anything is allocated for it.
+                        if (packet.size > chunk_size_limit || packet.chunk.size > max_encoded_size(packet.size)) {
+                            throw std::runtime_error("Oversized chunk received");
+                        }
+                        // The payload is read into the first position of the
+                        // chunk, unless it may not be touched: it is unknown,
+                        // already valid there, or being received elsewhere.
+                        std::vector<File*> targets;
+                        uint8_t* destination = nullptr;
+                        bool wanted = false;
+                        bool known_encoding = packet.encoding == zlib || (packet.encoding == raw && packet.chunk.size == packet.size);
+                        // Called with the mutex held.
+                        auto claim = [&] () {
+                            if (present_chunks.count(hash) || receiving_chunks.count(hash)) return;
+                            targets = chunk_files.at(hash);
+                            destination = targets[0]->get_chunk_destination(hash);
+                            receiving_chunks.insert(hash);
+                            multicast_chunks.erase(hash);
+                        };
+                        {
+                            lock_guard lock(mutex);
+                            auto it = chunk_files.find(hash);
+                            if (it == chunk_files.end()) {
+                                ui.log("Unknown chunk received!");
+                                report_failure(TransferFailedPacket(hash));
+                            } else if (!known_encoding) {
+                                ui.log("Unsupported chunk encoding received!");
+                                report_failure(TransferFailedPacket(hash));
+                            } else if (present_chunks.count(hash)) {
+                                // A copy that is not needed any more.
+                            } else if (it->second[0]->get_chunk_data(hash).size != packet.size) {
+                                ui.log("Chunk of the wrong size received!");
+                                report_failure(TransferFailedPacket(hash));
+                            } else {
+                                wanted = true;
+                                claim();
+                            }
+                        }
+                        // Compressed payloads and copies that may not go in
+                        // place yet are read aside, raw ones in place are
+                        // hashed frame by frame as they land. Frames are passed
+                        // on along a relay chain even if the chunk is of no use
+                        // here, and failing to pass them on does not keep the
+                        // chunk from being received.
+                        std::shared_ptr<std::vector<uint8_t>> encoded;
+                        uint8_t* buffer = destination;
+                        bool hashing = destination && packet.encoding == raw;
+                        ChunkHasher hasher;
+                        tcp::socket next(io_service);
+                        address next_addr;
+                        // A hop that does not get the whole chunk is reported,
+                        // and the server drops the rest of the chain with it.
+                        bool forwarding = !packet.relays.peers.empty() && open_relay(packet, next, next_addr, yield);
+                        if (!packet.relays.peers.empty() && !forwarding) {
+                            report_failure(TransferFailedPacket(hash, packet.relays.peers[0]));
                         }
-                        for (auto x: chunk_files.at(hash)) {
-                            x->write_chunk(packet.get_chunk(), hash);
+                        try {
+                            if (!hashing) {
+                                encoded = std::make_shared<std::vector<uint8_t>>(packet.chunk.size);
+                                buffer = encoded->data();
+                            }
+                            while (!packet.complete()) {
+                                ChunkFramePacket frame = packet.read_frame(reader, yield, buffer);
+                                if (hashing) hasher.update(frame.data.data, frame.data.data + frame.data.size);
+                                if (!forwarding) continue;
+                                try {
+                                    send_packet(next, yield, frame);
+                                } catch (const std::exception& e) {
+                                    lock_guard lock(mutex);
+                                    ui.log("Relay: " + std::string(e.what()));
+                                    forwarding = false;
+                                    report_failure(TransferFailedPacket(hash, packet.relays.peers[0]));
+                                }
+                            }
+                        } catch (...) {
+                            if (forwarding) report_failure(TransferFailedPacket(hash, packet.relays.peers[0]));
+                            if (!destination) throw;
+                            lock_guard lock(mutex);
+                            auto spare = spare_chunks.find(hash);
+                            if (spare == spare_chunks.end()) {
+                                receiving_chunks.erase(hash);
+                            } else {
+                                verify_copy(hash, targets, destination, packet.size, spare->second.first, spare->second.second);
+                                spare_chunks.erase(spare);
+                            }
+                            throw;
                         }
-                        present_chunks.insert(hash);
-                        boost::asio::spawn(server_strand, std::bind(new_chunk_sender, hash, _1));
+                        if (forwarding) {
+                            lock_guard lock(mutex);
+                            if (peers[packet.relays.peers[0]] == next_addr) client_sockets.emplace(packet.relays.peers[0], std::move(next));
+                        }
+                        // A copy that arrived while another one was being
+                        // received is kept until that one is done, as the
+                        // server already counts on it if the other failed.
+                        if (!destination && wanted) {
+                            lock_guard lock(mutex);
+                            claim();
+                            if (destination) {
+                                verify_copy(hash, targets, destination, packet.size, packet.encoding, encoded);
+                            } else if (receiving_chunks.count(hash)) {
+                                spare_chunks[hash] = std::make_pair(packet.encoding, encoded);
+                            }
+                            break;
+                        }
+                        if (!destination) break;
+                        // The chunk stays in receiving_chunks until it is
+                        // verified, so nothing else writes to its positions.
+                        verify_chunk(hash, targets, destination, packet.size, encoded, hashing && hasher.get() == hash);
                         break;
                     }
                     case error: {
-                        ui.log("Received error from client: " + ErrorPacket(socket, yield).get_as_string());
+                        std::string message = ErrorPacket(reader).get_as_string();
+                        lock_guard lock(mutex);
+                        ui.log("Received error from client: " + message);
                         break;
                     }
                     default: {
+                        lock_guard lock(mutex);
                         ui.log("Unknown packet type from client: " + std::to_string(type));
                     }
                 }
-                ui.report_status(files);
-                if (forever) continue;
-                if (files_to_get.size() == files.size() && chunk_files.size() == present_chunks.size()) {
-                    io_service.stop();
-                    break;
-                }
             }
         } catch (const std::exception& e) {
+            lock_guard lock(mutex);
             ui.log("Client communication: " + std::string(e.what()));
         }
     };
 
+    // Fragments are copied under the mutex, so a chunk that starts arriving
+    // over TCP simply stops being assembled here. Chunks being received or
+    // verified count as present when answering the end of a round.
+    auto multicast_listener = [this, &io_service, &verify_chunk, &send_to_server] (boost::asio::yield_context yield) {
+        try {
+            udp::socket probe(io_service);
+            probe.connect(udp::endpoint(server_ip, server_port));
+            MulticastReceiver receiver(io_service, multicast_group, probe.local_endpoint().address());
+            MulticastFragment fragment;
+            MulticastRoundEnd round_end;
+            for (;;) {
+                multicast_kind kind = receiver.receive(yield, fragment, round_end);
+                lock_guard lock(mutex);
+                if (kind == multicast_round_end) {
+                    auto it = file_chunks.find(round_end.name);
+                    if (it == file_chunks.end() || nacked_rounds[round_end.name] == round_end.round) continue;
+                    nacked_rounds[round_end.name] = round_end.round;
+                    NackPacket packet(round_end.name, round_end.round, it->second.size());
+                    for (size_t i=0; i<it->second.size(); i++) {
+                        const hash_t& x = it->second[i];
+                        if (!present_chunks.count(x) && !receiving_chunks.count(x)) packet.set_missing(i);
+                    }
+                    send_to_server(encode_packet(packet));
+                    continue;
+                }
+                const hash_t& hash = fragment.hash;
+                auto files_it = chunk_files.find(hash);
+                if (files_it == chunk_files.end() || present_chunks.count(hash) || receiving_chunks.count(hash)) continue;
+                auto it = multicast_chunks.find(hash);
+                if (it == multicast_chunks.end()) {
+                    File* first = files_it->second[0];
+                    if (first->get_chunk_data(hash).size != fragment.size) continue;
+                    it = multicast_chunks.emplace(hash, MulticastChunk(files_it->second, first->get_chunk_destination(hash), fragment.size)).first;
+                }
+                MulticastChunk& chunk = it->second;
+                size_t index = fragment.offset / multicast_fragment_size;
+                if (fragment.offset % multicast_fragment_size || index >= chunk.received.size() || chunk.received[index]) continue;
+                if (fragment.data.size != std::min(multicast_fragment_size, chunk.size - fragment.offset)) continue;
+                memcpy(chunk.destination + fragment.offset, fragment.data.data, fragment.data.size);
+                chunk.received[index] = true;
+                if (--chunk.remaining) continue;
+                receiving_chunks.insert(hash);
+                verify_chunk(hash, chunk.targets, chunk.destination, chunk.size, nullptr, false);
+                multicast_chunks.erase(it);
+            }
+        } catch (const std::exception& e) {
+            lock_guard lock(mutex);
+            ui.log("Multicast: " + std::string(e.what()));
+        }
+    };
+
     auto peer_connect_listener = [this, &io_service, &peer_connect_handler] (boost::asio::yield_context yield) {
         try {
             tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), client_port));
@@ -166,13 +761,22 @@ void Client<UI>::run(bool forever) {
                 boost::asio::spawn(io_service, std::bind(peer_connect_handler, std::move(socket), _1));
             }
         } catch (const std::exception& e) {
+            lock_guard lock(mutex);
             ui.log("Client accept: " + std::string(e.what()));
         }
     };
 
     boost::asio::spawn(io_service, peer_connect_listener);
+    if (!multicast_group.is_unspecified()) boost::asio::spawn(io_service, multicast_listener);
     boost::asio::spawn(server_strand, server_communication_handler);
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<io_threads; i++) {
+        threads.emplace_back([&io_service] () {io_service.run();});
+    }
     io_service.run();
+    for (auto& x: threads) x.join();
+    std::unique_lock<std::mutex> lock(background_mutex);
+    background_done.wait(lock, [this] () {return background_tasks == 0;});
 }
 
 #endif
@@ -1,17 +1,39 @@
 #ifndef CN_COMMON_H
 #define CN_COMMON_H
 #include <stdint.h>
+#include <string>
+#include <vector>
 #include <unordered_set>
 #include <unordered_map>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/io_service.hpp>
 
 using namespace boost::asio::ip;
 
 const static size_t chunk_max_size = 0x00100000;
+const static size_t min_picked_chunk_size = 0x40000;
+const static size_t max_picked_chunk_size = 0x1000000;
+// Chunks any bigger would only make peers allocate more for each one.
+const static size_t chunk_size_limit = 0x4000000;
+const static size_t target_file_chunks = 1024;
 const static size_t n_retries = 5;
 const static short server_port = 5124;
 const static short client_port = 8546; 
+const static size_t default_upload_slots = 1;
+const static size_t default_download_slots = 1;
+const static size_t default_io_threads = 1;
+const static size_t compression_cache_size = 0x10000000;
+const static size_t new_chunks_batch = 256;
+const static size_t new_chunks_delay_ms = 5;
+const static short multicast_port = 5125;
+const static size_t multicast_fragment_size = 1400;
+const static size_t default_multicast_rate = 200;
+const static size_t multicast_rounds = 4;
+const static size_t multicast_min_receivers = 2;
+const static size_t multicast_wait_ms = 500;
+const static size_t chunk_frame_size = 0x10000;
+const static size_t default_store_quota = 0x1000000000;
 
 class sha224_t: public std::array<uint8_t, 28> {};
 
@@ -19,7 +41,6 @@ struct hash_t {
     uint32_t weak_hash;
     sha224_t strong_hash;
     hash_t() {}
-    hash_t(tcp::socket& socket, boost::asio::yield_context yield);
     hash_t(uint32_t weak, sha224_t strong): weak_hash(weak), strong_hash(strong) {}
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers) const;
     bool operator==(const hash_t& other) const {
@@ -37,25 +58,55 @@ namespace std {
             return hash.weak_hash;
         }
     };
-    template <>
-    class hash<address>{
-    public:
-        size_t operator()(const address& addr) const noexcept {
-            return std::hash<std::string>()(addr.to_string());
-        }
-    };
+};
+
+// A chunk going from sender to receiver, and from there on along relays.
+struct Transfer {
+    size_t sender;
+    size_t receiver;
+    hash_t chunk;
+    std::vector<size_t> relays;
+    Transfer(size_t sender, size_t receiver, const hash_t& chunk): sender(sender), receiver(receiver), chunk(chunk) {}
 };
 
 class ClientStatus {
 public:
-    boost::asio::strand strand;
+    boost::asio::io_service::strand strand;
     tcp::socket socket;
-    std::unordered_set<hash_t> chunks_owned;
-    std::unordered_set<hash_t> chunks_needed;
+    size_t id;
+    address addr;
+    // The address last sent to this client for each peer id.
+    std::vector<address> announced;
+    // Encoded answers to the requests of this client, in order.
+    std::vector<std::shared_ptr<const std::vector<uint8_t>>> replies;
+    // Peers to announce before chunks are relayed through this client.
+    std::vector<size_t> announcements;
+    std::vector<Transfer> commands;
+    bool sending_commands;
     ClientStatus() = delete;
-    ClientStatus(tcp::socket socket, boost::asio::io_service& io_service): strand(io_service), socket(std::move(socket)) {}
+    ClientStatus(tcp::socket socket, boost::asio::io_service& io_service, size_t id, address addr):
+        strand(io_service), socket(std::move(socket)), id(id), addr(addr), sending_commands(false) {}
+};
+
+// What both clients are started with.
+struct ClientOptions {
+    address server_ip;
+    std::string base_dir;
+    std::vector<std::string> files;
+    size_t upload_slots;
+    size_t download_slots;
+    size_t io_threads;
+    bool compress;
+    address multicast_group;
+    std::string store_dir;
+    size_t store_quota;
+    ClientOptions(): upload_slots(default_upload_slots), download_slots(default_download_slots),
+        io_threads(default_io_threads), compress(false), store_quota(default_store_quota) {}
 };
 
+// Prints the usage and returns false if the command line does not parse.
+bool parse_client_options(int argc, char** argv, ClientOptions& options);
+
 class Chunk {
 public:
     size_t size;
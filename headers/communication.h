@@ -5,8 +5,10 @@
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
+#include <memory>
 #include <vector>
 #include "common.h"
+#include "chunking.h"
 
 using namespace boost::asio::ip;
 
@@ -17,6 +19,12 @@ enum packet_type: uint8_t {
     send_chunk,
     get_file,
     file_info,
+    slots,
+    new_chunks,
+    peer_info,
+    nack,
+    chunk_frame,
+    transfer_failed,
     error = 255
 };
 
@@ -25,16 +33,99 @@ enum error_code: uint8_t {
     unknown_packet = 255
 };
 
+enum chunk_encoding: uint8_t {
+    raw,
+    zlib
+};
+
+// Every packet goes out as a frame: its length, then its type and fields.
+// Chunk data is the exception, its payload follows the frame unframed so it
+// can be read to its destination directly. The payload of a chunk is split
+// into frames of chunk_frame_size, that can be checked and passed on while
+// the rest is still arriving.
+const static size_t max_frame_size = 0x4000000;
+
+// Reads frames of one connection through a buffer, so that a packet
+// usually costs a single read, and lets the packets decode their fields
+// from memory.
+class PacketReader {
+    tcp::socket& socket;
+    std::vector<uint8_t> buffer;
+    size_t begin;
+    size_t end;
+    size_t frame_end;
+    void fill(size_t bytes, boost::asio::yield_context yield);
+public:
+    PacketReader(const PacketReader&) = delete;
+    PacketReader& operator=(const PacketReader&) = delete;
+    PacketReader(tcp::socket& socket): socket(socket), buffer(0x4000), begin(0), end(0), frame_end(0) {}
+    packet_type next(boost::asio::yield_context yield);
+    void get(void* out, size_t size);
+    uint8_t get_uint8();
+    uint32_t get_uint32();
+    uint64_t get_uint64();
+    hash_t get_hash();
+    std::string get_string();
+    void get_hashes(std::vector<hash_t>& hashes);
+    void read_payload(boost::asio::yield_context yield, uint8_t* destination, size_t size);
+};
+
+// Peers a chunk is passed on to, in order, by each one as it arrives. They
+// are named by their ids, which each peer of the chain was told about.
+class RelayList {
+    uint8_t count;
+    std::vector<uint32_t> netids;
+public:
+    std::vector<uint32_t> peers;
+    RelayList(): count(0) {}
+    template<typename Iterator>
+    RelayList(Iterator begin, Iterator end): count(0), peers(begin, end) {}
+    RelayList(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+// One frame of a chunk's payload: its offset and size, followed by the data.
+class ChunkFramePacket {
+    uint32_t netoffset;
+    uint32_t netsize;
+public:
+    const static packet_type type = chunk_frame;
+    uint32_t offset;
+    Chunk data;
+    ChunkFramePacket(uint32_t offset, const Chunk& data): offset(offset), data(data) {}
+    ChunkFramePacket(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+    void add_payload(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+// An outgoing packet only refers to the chunk, which has to stay mapped
+// until the packet is sent; its frames go out in the same write. The hash,
+// encoding and decoded size come first, so that a receiver can decide
+// where the payload goes before reading it, whole with read_data or frame
+// by frame with read_frame.
 class ChunkDataPacket {
+    uint32_t netsize;
     uint32_t netlength;
+    size_t received;
+    std::vector<ChunkFramePacket> frames;
+    std::vector<std::pair<packet_type, uint32_t>> frame_headers;
 public:
     const static packet_type type = chunk_data;
-    std::vector<uint8_t> data;
-    ChunkDataPacket(const uint8_t* ptr, size_t size);
-    ChunkDataPacket(const Chunk& chunk): ChunkDataPacket(chunk.data, chunk.size) {}
-    ChunkDataPacket(tcp::socket& socket, boost::asio::yield_context yield);
-//    hash_t get_hash() const;
+    hash_t hash;
+    chunk_encoding encoding;
+    uint32_t size;
+    Chunk chunk;
+    RelayList relays;
+    ChunkDataPacket(const hash_t& hash, const Chunk& chunk, const RelayList& relays = RelayList()):
+        netsize(0), netlength(0), received(0), hash(hash), encoding(raw), size(chunk.size), chunk(chunk), relays(relays) {}
+    ChunkDataPacket(const hash_t& hash, uint32_t size, const Chunk& encoded, chunk_encoding encoding, const RelayList& relays = RelayList()):
+        netsize(0), netlength(0), received(0), hash(hash), encoding(encoding), size(size), chunk(encoded), relays(relays) {}
+    ChunkDataPacket(PacketReader& reader);
+    bool complete() const {return received == chunk.size;}
+    ChunkFramePacket read_frame(PacketReader& reader, boost::asio::yield_context yield, uint8_t* destination);
+    void read_data(PacketReader& reader, boost::asio::yield_context yield, uint8_t* destination);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+    void add_payload(std::vector<boost::asio::const_buffer>& buffers);
     Chunk get_chunk() const;
 };
 
@@ -45,12 +136,8 @@ public:
     std::vector<hash_t> chunks;
     ChunkListPacket() {}
     template<typename Iterator, typename boost::enable_if<boost::is_same<typename std::iterator_traits<Iterator>::value_type, hash_t>, int>::type = 0>
-    ChunkListPacket(Iterator begin, Iterator end) {
-        for (Iterator it=begin; it!=end; it++) {
-            chunks.push_back(*it);
-        }
-    }
-    ChunkListPacket(tcp::socket& socket, boost::asio::yield_context yield);
+    ChunkListPacket(Iterator begin, Iterator end): chunks(begin, end) {}
+    ChunkListPacket(PacketReader& reader);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
 };
 
@@ -59,19 +146,80 @@ public:
     const static packet_type type = new_chunk;
     hash_t chunk;
     NewChunkPacket(hash_t chunk): chunk(chunk) {}
-    NewChunkPacket(tcp::socket& socket, boost::asio::yield_context yield): chunk(socket, yield) {}
+    NewChunkPacket(PacketReader& reader): chunk(reader.get_hash()) {}
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
 };
 
-class SendChunkPacket {
-    std::string receiver_str;
+// Chunks a client acquired since its last update, sent as one message.
+class NewChunksPacket {
     uint32_t netlength;
+public:
+    const static packet_type type = new_chunks;
+    std::vector<hash_t> chunks;
+    template<typename Iterator, typename boost::enable_if<boost::is_same<typename std::iterator_traits<Iterator>::value_type, hash_t>, int>::type = 0>
+    NewChunksPacket(Iterator begin, Iterator end): netlength(0), chunks(begin, end) {}
+    NewChunksPacket(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+// Peers are named by the ids the server gives them; a client learns the
+// address behind an id from a PeerInfoPacket sent before the id is used.
+class PeerInfoPacket {
+    std::string addr_str;
+    uint32_t netid;
+    uint32_t netlength;
+public:
+    const static packet_type type = peer_info;
+    uint32_t id;
+    address addr;
+    PeerInfoPacket(uint32_t id, address addr): id(id), addr(addr) {}
+    PeerInfoPacket(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+class SendChunkPacket {
+    uint32_t netreceiver;
 public:
     const static packet_type type = send_chunk;
-    address receiver;
+    uint32_t receiver;
+    hash_t chunk;
+    RelayList relays;
+    SendChunkPacket(uint32_t receiver, hash_t chunk, const RelayList& relays = RelayList()): receiver(receiver), chunk(chunk), relays(relays) {}
+    SendChunkPacket(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+// The chunks of a file that a client still lacks after a multicast round,
+// as a bitmap over the file's chunk list. Round 0 asks to take part in the
+// multicast of the file.
+class NackPacket {
+    uint32_t netlength;
+    uint32_t netround;
+    uint32_t netcount;
+public:
+    const static packet_type type = nack;
+    std::string name;
+    uint32_t round;
+    uint32_t count;
+    std::vector<uint8_t> missing;
+    NackPacket(const std::string& name, uint32_t round, uint32_t count): name(name), round(round), count(count), missing((count+7)/8) {}
+    NackPacket(PacketReader& reader);
+    void set_missing(size_t chunk) {missing[chunk/8] |= 1 << chunk%8;}
+    bool is_missing(size_t chunk) const {return missing[chunk/8] >> chunk%8 & 1;}
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+// A transfer a client gave up on: the chunk will not get to the receiver,
+// which is the reporting client itself unless another peer is named.
+class TransferFailedPacket {
+    uint32_t netreceiver;
+public:
+    const static packet_type type = transfer_failed;
+    const static uint32_t self = 0xFFFFFFFF;
+    uint32_t receiver;
     hash_t chunk;
-    SendChunkPacket(address receiver, hash_t chunk): receiver(receiver), chunk(chunk) {}
-    SendChunkPacket(tcp::socket& socket, boost::asio::yield_context yield);
+    TransferFailedPacket(const hash_t& chunk, uint32_t receiver = self): receiver(receiver), chunk(chunk) {}
+    TransferFailedPacket(PacketReader& reader);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
 };
 
@@ -81,21 +229,41 @@ public:
     const static packet_type type = get_file;
     std::string name;
     GetFilePacket(const std::string& name): name(name) {}
-    GetFilePacket(tcp::socket& socket, boost::asio::yield_context yield);
+    GetFilePacket(PacketReader& reader);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
 };
 
+// The chunk sizes only go on the wire with content-defined chunking; with
+// fixed chunking the receiver works them out from the file size.
 class FileInfoPacket {
     uint32_t netlength;
     uint64_t netfsize;
+    uint8_t mode;
+    uint32_t netchunking[3];
+    std::vector<uint32_t> netsizes;
 public:
     const static packet_type type = file_info;
     std::string name;
-    uint32_t size;
+    uint64_t size;
+    Chunking chunking;
     ChunkListPacket chunk_list;
+    std::vector<uint32_t> chunk_sizes;
     template<typename Iterator, typename boost::enable_if<boost::is_same<typename std::iterator_traits<Iterator>::value_type, hash_t>, int>::type = 0>
-    FileInfoPacket(std::string name, uint32_t size, Iterator begin, Iterator end): name(name), size(size), chunk_list(begin, end) {}
-    FileInfoPacket(tcp::socket& socket, boost::asio::yield_context yield);
+    FileInfoPacket(std::string name, uint64_t size, const Chunking& chunking, Iterator begin, Iterator end, const std::vector<uint32_t>& chunk_sizes):
+        name(name), size(size), chunking(chunking), chunk_list(begin, end), chunk_sizes(chunk_sizes) {}
+    FileInfoPacket(PacketReader& reader);
+    void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
+};
+
+class SlotsPacket {
+    uint32_t netupload;
+    uint32_t netdownload;
+public:
+    const static packet_type type = slots;
+    uint32_t upload;
+    uint32_t download;
+    SlotsPacket(uint32_t upload, uint32_t download): upload(upload), download(download) {}
+    SlotsPacket(PacketReader& reader);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
 };
 
@@ -104,19 +272,73 @@ public:
     const static packet_type type = error;
     error_code code;
     ErrorPacket(error_code code): code(code) {}
-    ErrorPacket(tcp::socket& socket, boost::asio::yield_context yield);
+    ErrorPacket(PacketReader& reader);
     void add_buffers(std::vector<boost::asio::const_buffer>& buffers);
     const std::string get_as_string() const;
 };
 
 template<typename PacketType>
-void send_packet(tcp::socket& socket, boost::asio::yield_context yield, PacketType packet) {
-    packet_type type = PacketType::type;
-    std::vector<boost::asio::const_buffer> buffers;
+void add_payload(PacketType& packet, std::vector<boost::asio::const_buffer>& buffers) {}
+
+inline void add_payload(ChunkDataPacket& packet, std::vector<boost::asio::const_buffer>& buffers) {
+    packet.add_payload(buffers);
+}
+
+inline void add_payload(ChunkFramePacket& packet, std::vector<boost::asio::const_buffer>& buffers) {
+    packet.add_payload(buffers);
+}
+
+// Appends the frame of packet to buffers, which then refer to packet, type
+// and netlength.
+template<typename PacketType>
+void frame_packet(PacketType& packet, packet_type& type, uint32_t& netlength, std::vector<boost::asio::const_buffer>& buffers,
+                  bool payload = true) {
+    type = PacketType::type;
+    size_t first = buffers.size();
+    buffers.emplace_back(&netlength, 4);
     buffers.emplace_back(&type, 1);
     packet.add_buffers(buffers);
+    size_t length = 0;
+    for (size_t i=first+1; i<buffers.size(); i++) length += boost::asio::buffer_size(buffers[i]);
+    netlength = htonl(length);
+    if (payload) add_payload(packet, buffers);
+}
+
+template<typename PacketType>
+void send_packet(tcp::socket& socket, boost::asio::yield_context yield, PacketType packet) {
+    packet_type type;
+    uint32_t netlength;
+    std::vector<boost::asio::const_buffer> buffers;
+    frame_packet(packet, type, netlength, buffers);
     boost::asio::async_write(socket, buffers, yield);
 }
 
-packet_type get_packet_type(tcp::socket& socket, boost::asio::yield_context yield);
+// Sends the frame of a chunk without its payload, whose frames the caller
+// sends after it as they become available.
+inline void send_header(tcp::socket& socket, boost::asio::yield_context yield, ChunkDataPacket packet) {
+    packet_type type;
+    uint32_t netlength;
+    std::vector<boost::asio::const_buffer> buffers;
+    frame_packet(packet, type, netlength, buffers, false);
+    boost::asio::async_write(socket, buffers, yield);
+}
+
+// A packet framed once into an immutable buffer, for packets that are sent
+// unchanged to many peers.
+typedef std::shared_ptr<const std::vector<uint8_t>> EncodedPacket;
+
+template<typename PacketType>
+EncodedPacket encode_packet(PacketType packet) {
+    packet_type type;
+    uint32_t netlength;
+    std::vector<boost::asio::const_buffer> buffers;
+    frame_packet(packet, type, netlength, buffers);
+    auto encoded = std::make_shared<std::vector<uint8_t>>(boost::asio::buffer_size(buffers));
+    boost::asio::buffer_copy(boost::asio::buffer(*encoded), buffers);
+    return encoded;
+}
+
+inline void send_packet(tcp::socket& socket, boost::asio::yield_context yield, const EncodedPacket& packet) {
+    boost::asio::async_write(socket, boost::asio::buffer(*packet), yield);
+}
 #endif
@@ -0,0 +1,38 @@
+#ifndef CN_COMPRESSION_H
+#define CN_COMPRESSION_H
+#include "common.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Returns false when the chunk does not shrink enough to be worth sending
+// compressed.
+bool compress_chunk(const Chunk& chunk, std::vector<uint8_t>& out);
+bool decompress_chunk(const Chunk& compressed, uint8_t* out, size_t size);
+// The largest payload a chunk of size bytes is ever sent as.
+size_t max_encoded_size(size_t size);
+
+// Compressed forms of recently sent chunks, up to a number of bytes, so
+// that a chunk sent to many receivers is compressed once. Chunks that do
+// not compress are remembered too, and get() returns nullptr for them.
+class CompressionCache {
+    typedef std::shared_ptr<const std::vector<uint8_t>> entry_t;
+    struct Entry {
+        entry_t data;
+        std::list<hash_t>::iterator position;
+    };
+    std::mutex mutex;
+    size_t capacity;
+    size_t used;
+    std::list<hash_t> lru;
+    std::unordered_map<hash_t, Entry> entries;
+    static size_t cost(const entry_t& data);
+public:
+    CompressionCache(const CompressionCache&) = delete;
+    CompressionCache& operator=(const CompressionCache&) = delete;
+    CompressionCache(size_t capacity): capacity(capacity), used(0) {}
+    entry_t get(const hash_t& hash, const Chunk& chunk);
+};
+#endif
@@ -1,6 +1,7 @@
 #ifndef CN_FILE_H
 #define CN_FILE_H
 #include "common.h"
+#include "chunking.h"
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
@@ -10,19 +11,29 @@ using namespace boost::iostreams;
 class File {
     mapped_file file;
     uint8_t* data;
+    // Where each chunk starts, followed by the size of the file.
+    std::vector<size_t> offsets;
     std::unordered_map<hash_t, std::vector<uint8_t*>> chunk_positions;
     std::unordered_set<hash_t> present_chunks;
-    void write_chunk(Chunk data, const hash_t& hash, const std::unordered_set<uint8_t*>& skip);
+    void set_positions(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes);
+    size_t chunk_size_at(const uint8_t* position) const;
 public:
     File(const File&) = delete;
     File& operator=(const File&) = delete;
+    // The mapping is shared, so positions stay valid in the new object.
+    File(File&&) = default;
     File(const std::string& path, size_t resize = 0);
     size_t size() const;
 //    uint8_t& operator[](size_t pos);
-    std::vector<hash_t> get_chunk_list() const;
+    std::vector<uint32_t> get_chunk_sizes(const Chunking& chunking) const;
+    std::vector<hash_t> get_chunk_list(const std::vector<uint32_t>& sizes) const;
     Chunk get_chunk_data(const hash_t& hash) const;
-    void write_chunk(Chunk data, const hash_t& hash);
-    void set_chunks_from_list(const std::vector<hash_t>& chunks);
+    uint8_t* get_chunk_destination(const hash_t& hash);
+    void copy_chunk(Chunk data, const hash_t& hash);
+    void set_chunk_present(const hash_t& hash);
+    // Returns the number of bytes taken from the old contents.
+    size_t set_chunks_from_list(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes, const Chunking& chunking);
+    void set_chunks_present(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes);
     const std::unordered_set<hash_t>& get_present_chunks() const;
     size_t count_total_chunks() const;
     size_t count_present_chunks() const;
@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <array>
+#include <string>
+#include <vector>
 #include "common.h"
 #include <boost/utility.hpp>
 
@@ -19,6 +21,13 @@ public:
     SHA224();
     void update(const uint8_t* begin, const uint8_t* end);
     sha224_t get();
+    // Whole messages of the same length are hashed this many at a time by
+    // hash_many on the backend chosen for this CPU.
+    static size_t lanes();
+    static void hash_many(const uint8_t* const* messages, size_t len, size_t count, sha224_t* out);
+    // Checks every accelerated backend this CPU supports against the scalar
+    // code, whether it was chosen or not, and names the ones it checked.
+    static bool check_backends(std::vector<std::string>& checked);
 };
 
 class Hasher {
@@ -35,4 +44,20 @@ public:
     hash_t get_strong_hash() const;
     Chunk get_chunk() const;
 };
+
+// Hashes a chunk piece by piece, in order, as it arrives.
+class ChunkHasher {
+    SHA224 strong_hash;
+    uint32_t weak_hash;
+public:
+    ChunkHasher(): weak_hash(0) {}
+    void update(const uint8_t* begin, const uint8_t* end);
+    hash_t get();
+};
+
+// Same values as a Hasher at least as long as the block gets, without
+// copying the data through its window.
+uint32_t get_block_weak_hash(const uint8_t* begin, const uint8_t* end);
+hash_t get_block_hash(const uint8_t* begin, const uint8_t* end);
+void get_block_hashes(const uint8_t* const* blocks, size_t len, size_t count, hash_t* out);
 #endif
@@ -0,0 +1,36 @@
+#ifndef CN_MANIFEST_H
+#define CN_MANIFEST_H
+#include "common.h"
+#include "chunking.h"
+#include <string>
+#include <vector>
+
+// A manifest file is a fixed header followed by the chunk hashes exactly as
+// hash_t is laid out in memory, so that it can be mapped and used in place.
+// With content-defined chunking the chunk sizes follow the hashes.
+struct ManifestHeader {
+    char magic[8];
+    uint64_t chunking;
+    uint64_t min_chunk_size;
+    uint64_t avg_chunk_size;
+    uint64_t max_chunk_size;
+    uint64_t file_size;
+    uint64_t mtime_ns;
+    uint64_t inode;
+    uint64_t chunk_count;
+    Chunking get_chunking() const {
+        return Chunking((chunking_mode) chunking, min_chunk_size, avg_chunk_size, max_chunk_size);
+    }
+};
+
+class ManifestCache {
+    std::string dir;
+    std::string manifest_path(const std::string& name) const;
+public:
+    ManifestCache(const std::string& dir): dir(dir) {}
+    static bool get_header(const std::string& file_path, const Chunking& chunking, ManifestHeader& header);
+    bool load(const std::string& name, const ManifestHeader& header, std::vector<hash_t>& chunks, std::vector<uint32_t>& sizes) const;
+    bool store(const std::string& name, const std::string& file_path, const ManifestHeader& header,
+               const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes) const;
+};
+#endif
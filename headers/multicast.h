@@ -0,0 +1,57 @@
+#ifndef CN_MULTICAST_H
+#define CN_MULTICAST_H
+#include "common.h"
+#include <string>
+#include <vector>
+#include <chrono>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+// Chunks are multicast in fragments of at most multicast_fragment_size
+// bytes, each naming its chunk, the chunk size and its own offset. After a
+// round of chunks the sender announces its end, which every receiver
+// answers with a NackPacket over TCP.
+enum multicast_kind: uint8_t {
+    multicast_fragment,
+    multicast_round_end
+};
+
+struct MulticastFragment {
+    hash_t hash;
+    uint32_t size;
+    uint32_t offset;
+    Chunk data;
+    MulticastFragment(): size(0), offset(0), data((size_t)0, nullptr) {}
+};
+
+struct MulticastRoundEnd {
+    uint32_t round;
+    std::string name;
+};
+
+// Sends to the group at a fixed rate, so that receivers that are not
+// reading at the moment lose as little as possible.
+class MulticastSender {
+    udp::socket socket;
+    udp::endpoint group;
+    double ns_per_byte;
+    std::chrono::steady_clock::time_point next_send;
+    boost::asio::steady_timer timer;
+    void pace(size_t bytes, boost::asio::yield_context yield);
+public:
+    MulticastSender(boost::asio::io_service& io_service, const address& group, const address& interface, size_t rate_mbit);
+    void send_chunk(const hash_t& hash, const Chunk& chunk, boost::asio::yield_context yield);
+    void send_round_end(uint32_t round, const std::string& name, boost::asio::yield_context yield);
+};
+
+// Joins the group on the given interface. The data of a received fragment
+// points into the receiver, and stays valid until the next receive.
+class MulticastReceiver {
+    udp::socket socket;
+    std::vector<uint8_t> buffer;
+public:
+    MulticastReceiver(boost::asio::io_service& io_service, const address& group, const address& interface);
+    multicast_kind receive(boost::asio::yield_context yield, MulticastFragment& fragment, MulticastRoundEnd& round_end);
+};
+#endif
@@ -0,0 +1,117 @@
+#ifndef CN_SCHEDULER_H
+#define CN_SCHEDULER_H
+#include "common.h"
+#include <vector>
+#include <unordered_map>
+
+// A set of dense chunk ids, stored as a bitmap.
+class ChunkBits {
+    std::vector<uint64_t> words;
+    size_t bits;
+public:
+    ChunkBits(): bits(0) {}
+    bool test(size_t id) const {return id/64 < words.size() && (words[id/64] >> id%64 & 1);}
+    bool set(size_t id);
+    bool reset(size_t id);
+    size_t size() const {return bits;}
+    size_t word_count() const {return words.size();}
+    uint64_t word(size_t i) const {return i < words.size() ? words[i] : 0;}
+    template<typename Function>
+    void for_each(Function f) const {
+        for (size_t i=0; i<words.size(); i++) {
+            for (uint64_t w = words[i]; w; w &= w-1) f(i*64 + __builtin_ctzll(w));
+        }
+    }
+};
+
+class PeerChunks {
+public:
+    ChunkBits owned;
+    ChunkBits needed;
+    ChunkBits missing;
+    ChunkBits receiving;
+    ChunkBits relayed;
+    std::unordered_map<size_t, size_t> incoming;
+};
+
+// Keeps the sender -> receiver "has something useful" graph up to date as
+// chunk lists arrive. Planned pairs form a matching in which every peer
+// uses at most its upload and download slots; it is kept between calls and
+// a pair is given another chunk whenever its last one arrives, until the
+// sender has nothing the receiver can take. Whenever slots free up or new
+// edges appear, the matching is extended with augmenting paths instead of
+// being recomputed. Each transfer carries the chunk with the fewest
+// replicas the receiver lacks.
+// With relays enabled, each new transfer is extended into a chain through
+// peers whose download slots the matching left free, every hop passing the
+// chunk on while it arrives.
+// Chunks are interned into dense ids on first sight, so that per-peer chunk
+// sets are bitmaps and picking a chunk is a word-wise intersection.
+class Scheduler {
+    std::unordered_map<hash_t, size_t> chunk_ids;
+    std::vector<hash_t> chunk_hashes;
+    std::vector<PeerChunks> peers;
+    std::vector<bool> active;
+    std::vector<size_t> free_ids;
+    std::vector<std::vector<size_t>> owners;
+    std::vector<std::vector<size_t>> wanting;
+    std::vector<ChunkBits> by_replicas;
+    std::vector<std::vector<size_t>> useful;
+    std::vector<size_t> out_degree;
+    std::vector<std::vector<size_t>> busy;
+    std::vector<std::vector<size_t>> carrying;
+    std::vector<size_t> upload_slots;
+    std::vector<size_t> download_slots;
+    std::vector<size_t> relay_uploads;
+    std::vector<size_t> relay_downloads;
+    std::vector<size_t> held;
+    std::vector<bool> seeds;
+    std::vector<std::vector<size_t>> planned;
+    std::vector<std::vector<size_t>> planned_by;
+    std::vector<size_t> visited;
+    std::vector<size_t> parent;
+    std::vector<size_t> sender_visited;
+    std::vector<size_t> via;
+    std::vector<size_t> failed_at;
+    size_t visit_stamp;
+    size_t generation;
+    size_t upload_slots_default;
+    size_t download_slots_default;
+    size_t max_relays;
+    size_t intern(const hash_t& chunk);
+    void update_replicas(size_t chunk, size_t old_replicas);
+    void add_useful(size_t sender, size_t receiver);
+    void remove_useful(size_t sender, size_t receiver);
+    bool can_upload(size_t sender) const;
+    bool can_download(size_t receiver) const;
+    size_t plans(size_t sender, size_t receiver) const;
+    bool idle(size_t sender, size_t receiver) const {return plans(sender, receiver) > carrying[sender][receiver];}
+    size_t pair_load(size_t sender, size_t receiver) const;
+    void plan(size_t sender, size_t receiver);
+    void unplan(size_t sender, size_t receiver);
+    bool over_slots(size_t sender, size_t receiver) const;
+    bool augment(size_t sender);
+    bool pick_chunk(size_t sender, size_t receiver, size_t& chunk) const;
+    void start_transfer(size_t sender, size_t receiver, size_t chunk, bool relay);
+    void finish_transfer(size_t receiver, size_t chunk);
+    void extend_chain(Transfer& transfer, size_t chunk);
+    void cancel_hop(size_t sender, size_t receiver, size_t chunk);
+    void drop_relays(size_t from, size_t chunk);
+public:
+    Scheduler(size_t upload_slots = default_upload_slots, size_t download_slots = default_download_slots):
+        visit_stamp(0), generation(1), upload_slots_default(upload_slots), download_slots_default(download_slots), max_relays(0) {}
+    size_t add_peer();
+    void remove_peer(size_t peer);
+    void set_slots(size_t peer, size_t upload, size_t download);
+    void set_seed(size_t peer);
+    void set_max_relays(size_t relays) {max_relays = relays;}
+    void hold(size_t peer);
+    void release(size_t peer);
+    void add_needed(size_t peer, const hash_t& chunk);
+    void add_owned(size_t peer, const hash_t& chunk);
+    void cancel_transfer(const Transfer& transfer);
+    void fail_transfer(size_t reporter, size_t receiver, const hash_t& chunk);
+    const PeerChunks& get_peer(size_t peer) const {return peers[peer];}
+    std::vector<Transfer> get_transfers();
+};
+#endif
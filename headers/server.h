@@ -2,113 +2,84 @@
 #define CN_SERVER_H
 #include "common.h"
 #include "communication.h"
+#include "compression.h"
+#include "multicast.h"
 #include "ui.h"
+#include "scheduler.h"
+#include "manifest.h"
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <mutex>
+#include <thread>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/spawn.hpp>
-#include <queue>
 
 using namespace boost::asio::ip;
 
+// Clients taking part in the multicast of a file, with the chunks each one
+// lacked at its last NACK. They are held in the scheduler until the session
+// ends, then what is left is repaired over TCP.
+struct MulticastSession {
+    uint32_t round;
+    std::unordered_map<size_t, std::vector<uint8_t>> missing;
+    std::unordered_set<size_t> waiting;
+    MulticastSession(): round(0) {}
+};
 
 template<class UI = DefaultUI>
 class Server {
     std::string base_dir;
-    std::unordered_multiset<address> is_busy;
-    std::unordered_map<address, ClientStatus> clients;
-    std::unordered_map<std::string, FileInfoPacket> files;
+    // Each file is cut with a chunk size picked for it, unless one is given.
+    chunking_mode chunking;
+    size_t chunk_size;
+    ManifestCache manifests;
+    // Clients and idle peer connections are keyed by scheduler peer id.
+    std::unordered_map<size_t, ClientStatus> clients;
+    std::unordered_map<std::string, std::vector<hash_t>> files;
+    // FileInfoPackets, encoded once when the files are scanned.
+    std::unordered_map<std::string, EncodedPacket> file_infos;
+    std::unordered_map<std::string, File> file_data;
+    std::unordered_map<hash_t, File*> chunk_files;
+    std::unordered_multimap<size_t, tcp::socket> peer_sockets;
+    Scheduler scheduler;
+    std::vector<address> peer_addresses;
+    size_t seed_slots;
+    size_t seed_id;
+    size_t io_threads;
+    bool compress;
+    CompressionCache compression_cache;
+    address multicast_group;
+    address multicast_interface;
+    size_t multicast_rate;
+    std::unordered_map<std::string, MulticastSession> multicast_sessions;
+    // Guards everything above and the UI once the io threads run. Recursive,
+    // as spawn may start a coroutine inline on the thread that holds it.
+    std::recursive_mutex mutex;
     UI ui;
-    std::unordered_map<address, std::pair<address, hash_t>> get_chunks_to_send() const;
 public:
-    Server(std::string base_dir): base_dir(base_dir), ui({"Client status"}) {}
+    Server(std::string base_dir, size_t upload_slots = default_upload_slots, size_t download_slots = default_download_slots,
+           size_t seed_slots = default_upload_slots, size_t io_threads = default_io_threads, bool compress = false,
+           std::string manifest_dir = "", address multicast_group = address(), address multicast_interface = address(),
+           size_t multicast_rate = default_multicast_rate, size_t max_relays = 0,
+           chunking_mode chunking = fixed_chunking, size_t chunk_size = 0):
+        base_dir(base_dir), chunking(chunking), chunk_size(chunk_size), manifests(manifest_dir.empty() ? base_dir + "/.manifests" : manifest_dir),
+        scheduler(upload_slots, download_slots), seed_slots(seed_slots), io_threads(io_threads),
+        compress(compress), compression_cache(compression_cache_size), multicast_group(multicast_group),
+        multicast_interface(multicast_interface), multicast_rate(multicast_rate), ui({"Client status"}) {
+        scheduler.set_max_relays(max_relays);
+    }
     void run();
 };
 
 using namespace boost::filesystem;
 
-template<class UI>
-std::unordered_map<address, std::pair<address, hash_t>> Server<UI>::get_chunks_to_send() const {
-    volatile size_t client_no = clients.size();
-    std::unordered_map<address, size_t> addr_to_id;
-    std::vector<address> id_to_addr;
-    for (auto& c: clients) {
-        addr_to_id.emplace(c.first, addr_to_id.size());
-        id_to_addr.push_back(c.first);
-    }
-    std::vector<std::vector<int>> fw_graph;
-    fw_graph.resize(client_no);
-    for (auto& c: clients) {
-        for (auto& oth: clients) {
-            for (auto& chunk: c.second.chunks_owned) {
-                if (oth.second.chunks_needed.count(chunk) && !oth.second.chunks_owned.count(chunk)) {
-                    fw_graph[addr_to_id[c.first]].push_back(addr_to_id[oth.first]);
-                    break;
-                }
-            }
-        }
-    }
-
-    std::vector<int> fw_match(client_no, -1);
-    std::vector<int> bw_match(client_no, -1);
-    for (;;) {
-        std::vector<int> parent(client_no, -1);
-        bool improved = false;
-        for (size_t i=0; i<client_no; i++) {
-            if (fw_match[i] != -1) continue;
-            std::queue<int> q;
-            q.push(i);
-            int augmenting = -1;
-            while(!q.empty()) {
-                int cur = q.front();
-                q.pop();
-                for (auto x: fw_graph[cur]) {
-                    if (parent[x] != -1) continue;
-                    if (fw_match[cur] == x) continue;
-                    parent[x] = cur;
-                    if (bw_match[x] == -1) {
-                        augmenting = x;
-                        break;
-                    } else {
-                        q.push(bw_match[x]);
-                    }
-                }
-                if (augmenting != -1) break;
-            }
-            while (augmenting != -1) {
-                improved = true;
-                int next = fw_match[parent[augmenting]];
-                bw_match[augmenting] = parent[augmenting];
-                fw_match[parent[augmenting]] = augmenting;
-                augmenting = next;
-            }
-        }
-        if (!improved) break;
-    }
-
-    std::unordered_map<address, std::pair<address, hash_t>> res;
-    for (size_t i=0; i<client_no; i++) {
-        if (fw_match[i] == -1) continue;
-        address sender = id_to_addr[i];
-        address receiver = id_to_addr[fw_match[i]];
-        hash_t chunk;
-        for (auto& x: clients.at(sender).chunks_owned) {
-            if (clients.at(receiver).chunks_needed.count(x) && !clients.at(receiver).chunks_owned.count(x)) {
-                chunk = x;
-                break;
-            }
-        }
-        res.emplace(sender, std::make_pair(receiver, chunk));
-    }
-    return res;
-}
-
 template<class UI>
 void Server<UI>::run() {
     using namespace std::placeholders;
+    typedef std::lock_guard<std::recursive_mutex> lock_guard;
     boost::asio::io_service io_service;
 
     ui.log("Generating file list...");
@@ -116,90 +87,385 @@ void Server<UI>::run() {
         std::string filename = x->path().filename().string();
         if (!is_regular_file(x->path())) continue;
         ui.log("Found " + filename);
-        const std::vector<hash_t>& chunk_list = File(x->path().string()).get_chunk_list();
-        files.emplace(
+        file_data.emplace(
             std::piecewise_construct,
             std::forward_as_tuple(filename),
-            std::forward_as_tuple(filename, file_size(*x), chunk_list.begin(), chunk_list.end()));
+            std::forward_as_tuple(x->path().string()));
+        File& file = file_data.at(filename);
+        const Chunking& file_chunking = pick_chunking(chunking, chunk_size, file.size());
+        std::vector<hash_t> chunk_list;
+        std::vector<uint32_t> chunk_sizes;
+        ManifestHeader header;
+        bool have_header = ManifestCache::get_header(x->path().string(), file_chunking, header);
+        if (!have_header || !manifests.load(filename, header, chunk_list, chunk_sizes)) {
+            ui.log("Hashing " + filename);
+            chunk_sizes = file.get_chunk_sizes(file_chunking);
+            chunk_list = file.get_chunk_list(chunk_sizes);
+            if (have_header && !manifests.store(filename, x->path().string(), header, chunk_list, chunk_sizes)) {
+                ui.log("Could not store the manifest of " + filename);
+            }
+        }
+        file.set_chunks_present(chunk_list, chunk_sizes);
+        for (auto& chunk: chunk_list) {
+            chunk_files.emplace(chunk, &file);
+        }
+        file_infos.emplace(filename, encode_packet(FileInfoPacket(filename, file.size(), file_chunking, chunk_list.begin(), chunk_list.end(), chunk_sizes)));
+        files.emplace(filename, std::move(chunk_list));
     }
     ui.log("File list complete!");
 
-    auto send_chunk_sender = [this] (address send, address dest, hash_t chunk, boost::asio::yield_context yield) {
+    // The server takes part in the matching as a peer that owns every chunk
+    // and only uploads, from its own mappings of the files.
+    seed_id = scheduler.add_peer();
+    scheduler.set_slots(seed_id, seed_slots, 0);
+    scheduler.set_seed(seed_id);
+    for (auto& x: chunk_files) {
+        scheduler.add_owned(seed_id, x.first);
+    }
+    if (peer_addresses.size() <= seed_id) peer_addresses.resize(seed_id+1);
+
+    auto chunk_data_sender = [this, &io_service] (Transfer transfer, boost::asio::yield_context yield) {
+        address receiver;
+        RelayList relays(transfer.relays.begin(), transfer.relays.end());
+        Chunk chunk((size_t)0, nullptr);
+        {
+            lock_guard lock(mutex);
+            receiver = peer_addresses[transfer.receiver];
+            chunk = chunk_files.at(transfer.chunk)->get_chunk_data(transfer.chunk);
+        }
+        std::shared_ptr<const std::vector<uint8_t>> compressed;
+        if (compress) compressed = compression_cache.get(transfer.chunk, chunk);
+        for (size_t i=0; i<n_retries; i++) {
+            try {
+                tcp::socket socket(io_service);
+                bool connected = false;
+                {
+                    lock_guard lock(mutex);
+                    auto idle = peer_sockets.find(transfer.receiver);
+                    if (idle != peer_sockets.end()) {
+                        socket = std::move(idle->second);
+                        peer_sockets.erase(idle);
+                        connected = true;
+                    }
+                }
+                if (!connected) socket.async_connect(tcp::endpoint(receiver, client_port), yield);
+                if (compressed) {
+                    send_packet(socket, yield, ChunkDataPacket(transfer.chunk, chunk.size, Chunk(compressed->size(), compressed->data()), zlib, relays));
+                } else {
+                    send_packet(socket, yield, ChunkDataPacket(transfer.chunk, chunk, relays));
+                }
+                lock_guard lock(mutex);
+                if (clients.count(transfer.receiver) && clients.at(transfer.receiver).addr == receiver) {
+                    peer_sockets.emplace(transfer.receiver, std::move(socket));
+                }
+                return;
+            } catch (const std::exception& e) {
+                lock_guard lock(mutex);
+                ui.log("Error sending chunk: " + std::string(e.what()));
+            }
+        }
+        lock_guard lock(mutex);
+        scheduler.cancel_transfer(transfer);
+    };
+
+    // Called with the mutex held. Whether the client has to be told the
+    // address of the peer first.
+    auto needs_announce = [this] (ClientStatus& client, size_t peer, address& addr) {
+        addr = peer_addresses[peer];
+        if (client.announced.size() <= peer) client.announced.resize(peer+1);
+        if (client.announced[peer] == addr) return false;
+        client.announced[peer] = addr;
+        return true;
+    };
+
+    // Everything written to a client, replies and commands, is queued and
+    // written by a single coroutine, as a write that yields could otherwise
+    // interleave with another one on its socket. A peer id is announced with
+    // a PeerInfoPacket before its first use, and again whenever the id has
+    // been given to another address.
+    auto send_chunk_sender = [this, &needs_announce] (size_t send, boost::asio::yield_context yield) {
+        std::vector<EncodedPacket> replies;
+        std::vector<Transfer> commands;
+        std::vector<size_t> announcements;
         try {
-            send_packet(clients.at(send).socket, yield, SendChunkPacket(dest, chunk));
+            for (;;) {
+                tcp::socket* socket;
+                {
+                    lock_guard lock(mutex);
+                    ClientStatus& client = clients.at(send);
+                    if (client.replies.empty() && client.commands.empty() && client.announcements.empty()) {
+                        client.sending_commands = false;
+                        break;
+                    }
+                    socket = &client.socket;
+                    replies.swap(client.replies);
+                    commands.swap(client.commands);
+                    announcements.swap(client.announcements);
+                }
+                for (auto& x: replies) {
+                    send_packet(*socket, yield, x);
+                }
+                replies.clear();
+                while (!announcements.empty()) {
+                    size_t peer = announcements.back();
+                    address addr;
+                    bool announce;
+                    {
+                        lock_guard lock(mutex);
+                        announce = needs_announce(clients.at(send), peer, addr);
+                    }
+                    if (announce) send_packet(*socket, yield, PeerInfoPacket(peer, addr));
+                    announcements.pop_back();
+                }
+                while (!commands.empty()) {
+                    const Transfer& command = commands.back();
+                    address receiver_addr;
+                    bool announce;
+                    {
+                        lock_guard lock(mutex);
+                        announce = needs_announce(clients.at(send), command.receiver, receiver_addr);
+                    }
+                    if (announce) send_packet(*socket, yield, PeerInfoPacket(command.receiver, receiver_addr));
+                    send_packet(*socket, yield, SendChunkPacket(command.receiver, command.chunk,
+                                                                RelayList(command.relays.begin(), command.relays.end())));
+                    commands.pop_back();
+                }
+            }
         } catch (std::exception& e) {
+            lock_guard lock(mutex);
             ui.log("Error sending command: " + std::string(e.what()));
+            if (!clients.count(send)) return;
+            ClientStatus& client = clients.at(send);
+            commands.insert(commands.end(), client.commands.begin(), client.commands.end());
+            for (auto& x: commands) {
+                scheduler.cancel_transfer(x);
+            }
+            client.replies.clear();
+            client.commands.clear();
+            client.announcements.clear();
+            client.sending_commands = false;
+        }
+    };
+
+    // Called with the mutex held.
+    auto start_sender = [this, &send_chunk_sender] (ClientStatus& client) {
+        if (client.sending_commands) return;
+        client.sending_commands = true;
+        boost::asio::spawn(client.strand, std::bind(send_chunk_sender, client.id, _1));
+    };
+
+    // Called with the mutex held. Each peer of a relay chain is told about
+    // the next one along with the command that starts the chain, so it
+    // usually knows the id by the time the chunk reaches it; if not, the
+    // rest of the chain is dropped.
+    auto send_chunks = [this, &io_service, &start_sender, &chunk_data_sender] () {
+        for (auto& x: scheduler.get_transfers()) {
+            size_t last = x.receiver;
+            for (auto r: x.relays) {
+                ClientStatus& relay = clients.at(last);
+                relay.announcements.push_back(r);
+                start_sender(relay);
+                last = r;
+            }
+            if (x.sender == seed_id) {
+                boost::asio::spawn(io_service, std::bind(chunk_data_sender, x, _1));
+                continue;
+            }
+            ClientStatus& client = clients.at(x.sender);
+            client.commands.push_back(x);
+            start_sender(client);
+        }
+    };
+
+    // The first round multicasts every chunk some receiver lacks, later rounds
+    // only those still lacked by several; a receiver that does not answer a
+    // round is left to TCP.
+    auto multicast_session = [this, &io_service, &send_chunks] (std::string name, boost::asio::yield_context yield) {
+        const std::vector<hash_t>& chunks = files.at(name);
+        boost::asio::steady_timer timer(io_service);
+        try {
+            MulticastSender sender(io_service, multicast_group, multicast_interface, multicast_rate);
+            timer.expires_after(std::chrono::milliseconds(multicast_wait_ms));
+            timer.async_wait(yield);
+            for (uint32_t round=1; round<=multicast_rounds; round++) {
+                std::vector<size_t> selected;
+                {
+                    lock_guard lock(mutex);
+                    MulticastSession& session = multicast_sessions.at(name);
+                    std::vector<size_t> lacking(chunks.size());
+                    for (auto& x: session.missing) {
+                        for (size_t i=0; i<chunks.size(); i++) lacking[i] += x.second[i/8] >> i%8 & 1;
+                    }
+                    size_t threshold = round == 1 ? 1 : multicast_min_receivers;
+                    std::unordered_set<hash_t> seen;
+                    for (size_t i=0; i<chunks.size(); i++) {
+                        if (lacking[i] >= threshold && seen.insert(chunks[i]).second) selected.push_back(i);
+                    }
+                    if (selected.empty()) break;
+                    session.round = round;
+                    session.waiting.clear();
+                    for (auto& x: session.missing) session.waiting.insert(x.first);
+                    ui.log("Multicasting " + std::to_string(selected.size()) + " chunks of " + name + " to "
+                        + std::to_string(session.missing.size()) + " clients, round " + std::to_string(round));
+                }
+                for (auto i: selected) {
+                    Chunk chunk((size_t)0, nullptr);
+                    {
+                        lock_guard lock(mutex);
+                        chunk = chunk_files.at(chunks[i])->get_chunk_data(chunks[i]);
+                    }
+                    sender.send_chunk(chunks[i], chunk, yield);
+                }
+                // The end of a round is repeated, as a receiver that misses it
+                // drops out of the session.
+                for (size_t i=0; i<3; i++) {
+                    sender.send_round_end(round, name, yield);
+                    timer.expires_after(std::chrono::milliseconds(1));
+                    timer.async_wait(yield);
+                }
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(multicast_wait_ms);
+                for (;;) {
+                    {
+                        lock_guard lock(mutex);
+                        MulticastSession& session = multicast_sessions.at(name);
+                        if (session.waiting.empty() || std::chrono::steady_clock::now() >= deadline) {
+                            for (auto id: session.waiting) {
+                                session.missing.erase(id);
+                                scheduler.release(id);
+                            }
+                            session.waiting.clear();
+                            break;
+                        }
+                    }
+                    timer.expires_after(std::chrono::milliseconds(10));
+                    timer.async_wait(yield);
+                }
+            }
+        } catch (const std::exception& e) {
+            lock_guard lock(mutex);
+            ui.log("Multicast: " + std::string(e.what()));
+        }
+        lock_guard lock(mutex);
+        for (auto& x: multicast_sessions.at(name).missing) {
+            scheduler.release(x.first);
         }
+        multicast_sessions.erase(name);
+        send_chunks();
     };
 
-    auto client_manager = [this, &send_chunk_sender] (address addr, boost::asio::yield_context yield) {
+    // Reads the packets of a client; its answers go out through its
+    // send_chunk_sender.
+    auto client_manager = [this, &io_service, &send_chunks, &multicast_session, &start_sender] (size_t id, boost::asio::yield_context yield) {
         try {
-            tcp::socket& socket = clients.at(addr).socket;
+            tcp::socket* socket_ptr;
+            {
+                lock_guard lock(mutex);
+                socket_ptr = &clients.at(id).socket;
+            }
+            tcp::socket& socket = *socket_ptr;
+            PacketReader reader(socket);
             for (;;) {
-                packet_type type = get_packet_type(socket, yield);
+                packet_type type = reader.next(yield);
                 switch (type) {
                     case get_file: {
-                        GetFilePacket packet(socket, yield);
+                        GetFilePacket packet(reader);
+                        lock_guard lock(mutex);
+                        ClientStatus& client = clients.at(id);
                         if (!files.count(packet.name)) {
-                            send_packet(socket, yield, ErrorPacket(no_such_file));
+                            client.replies.push_back(encode_packet(ErrorPacket(no_such_file)));
                         } else  {
-                            for (auto& x: files.at(packet.name).chunk_list.chunks) {
-                                clients.at(addr).chunks_needed.insert(x);
+                            scheduler.hold(id);
+                            for (auto& x: files.at(packet.name)) {
+                                scheduler.add_needed(id, x);
                             }
-                            send_packet(socket, yield, files.at(packet.name));
+                            client.replies.push_back(file_infos.at(packet.name));
                         }
-                        is_busy.insert(addr);
+                        start_sender(client);
                         break;
                     }
                     case chunk_list: {
-                        ChunkListPacket packet(socket, yield);
+                        ChunkListPacket packet(reader);
+                        lock_guard lock(mutex);
                         for (auto& x: packet.chunks) {
-                            clients.at(addr).chunks_owned.insert(x);
-                        }
-                        if (is_busy.count(addr)) {
-                            is_busy.erase(is_busy.find(addr));
+                            scheduler.add_owned(id, x);
                         }
+                        scheduler.release(id);
                         break;
                     }
                     case new_chunk: {
-                        NewChunkPacket packet(socket, yield);
-                        clients.at(addr).chunks_owned.insert(packet.chunk);
-                        if (is_busy.count(addr)) {
-                            is_busy.erase(is_busy.find(addr));
+                        NewChunkPacket packet(reader);
+                        lock_guard lock(mutex);
+                        scheduler.add_owned(id, packet.chunk);
+                        break;
+                    }
+                    case new_chunks: {
+                        NewChunksPacket packet(reader);
+                        lock_guard lock(mutex);
+                        for (auto& x: packet.chunks) {
+                            scheduler.add_owned(id, x);
                         }
                         break;
                     }
+                    case nack: {
+                        NackPacket packet(reader);
+                        lock_guard lock(mutex);
+                        if (multicast_group.is_unspecified() || !files.count(packet.name)) break;
+                        if (packet.count != files.at(packet.name).size()) break;
+                        if (packet.round == 0) {
+                            bool start = !multicast_sessions.count(packet.name);
+                            MulticastSession& session = multicast_sessions[packet.name];
+                            if (!session.missing.count(id)) scheduler.hold(id);
+                            session.missing[id] = std::move(packet.missing);
+                            if (start) boost::asio::spawn(io_service, std::bind(multicast_session, packet.name, _1));
+                            break;
+                        }
+                        auto it = multicast_sessions.find(packet.name);
+                        if (it == multicast_sessions.end() || it->second.round != packet.round) break;
+                        if (it->second.waiting.erase(id)) it->second.missing[id] = std::move(packet.missing);
+                        break;
+                    }
+                    case transfer_failed: {
+                        TransferFailedPacket packet(reader);
+                        lock_guard lock(mutex);
+                        size_t receiver = packet.receiver == TransferFailedPacket::self ? id : packet.receiver;
+                        scheduler.fail_transfer(id, receiver, packet.chunk);
+                        break;
+                    }
+                    case slots: {
+                        SlotsPacket packet(reader);
+                        lock_guard lock(mutex);
+                        scheduler.set_slots(id, packet.upload, packet.download);
+                        break;
+                    }
                     case error: {
-                        ui.log("Received error from client: " + ErrorPacket(socket, yield).get_as_string());
+                        std::string message = ErrorPacket(reader).get_as_string();
+                        lock_guard lock(mutex);
+                        ui.log("Received error from client: " + message);
                         break;
                     }
                     default: {
+                        lock_guard lock(mutex);
                         ui.log("Unknown packet type from client: " + std::to_string(type));
-                        ErrorPacket answer(unknown_packet);
-                        send_packet(socket, yield, answer);
-                    }
-                }
-                ui.report_client_status(clients);
-                if (is_busy.empty()) {
-                    for (auto& x: get_chunks_to_send()) {
-                        boost::asio::spawn(clients.at(x.first).strand, std::bind(send_chunk_sender, x.first, x.second.first, x.second.second, _1));
-                        is_busy.insert(x.second.first);
+                        clients.at(id).replies.push_back(encode_packet(ErrorPacket(unknown_packet)));
+                        start_sender(clients.at(id));
                     }
                 }
+                lock_guard lock(mutex);
+                ui.report_client_status(clients, scheduler);
+                send_chunks();
             }
         } catch (std::exception& e) {
+            lock_guard lock(mutex);
             try {
                 ui.log("Error handling client: " + std::string(e.what()));
-                clients.erase(addr);
-                if (is_busy.count(addr)) {
-                    is_busy.erase(is_busy.find(addr));
-                }
-                if (is_busy.empty()) {
-                    for (auto& x: get_chunks_to_send()) {
-                        boost::asio::spawn(clients.at(x.first).strand, std::bind(send_chunk_sender, x.first, x.second.first, x.second.second, _1));
-                        is_busy.insert(x.second.first);
-                    }
+                scheduler.remove_peer(id);
+                for (auto& x: multicast_sessions) {
+                    x.second.missing.erase(id);
+                    x.second.waiting.erase(id);
                 }
+                clients.erase(id);
+                peer_sockets.erase(id);
+                send_chunks();
             } catch (std::exception& e) {
                 ui.log("Error handling exception: " + std::string(e.what()));
             }
@@ -213,15 +479,25 @@ void Server<UI>::run() {
                 tcp::socket socket(io_service);
                 acceptor.async_accept(socket, yield);
                 address addr = socket.remote_endpoint().address();
-                clients.emplace(addr, std::move(ClientStatus(std::move(socket), io_service)));
-                boost::asio::spawn(io_service, std::bind(client_manager, addr, _1));
+                lock_guard lock(mutex);
+                size_t id = scheduler.add_peer();
+                if (peer_addresses.size() <= id) peer_addresses.resize(id+1);
+                peer_addresses[id] = addr;
+                clients.emplace(id, std::move(ClientStatus(std::move(socket), io_service, id, addr)));
+                boost::asio::spawn(clients.at(id).strand, std::bind(client_manager, id, _1));
             }
         } catch (const std::exception& e) {
+            lock_guard lock(mutex);
             ui.log("Client accept: " + std::string(e.what()));
         }
     };
 
     boost::asio::spawn(io_service, client_connect_listener);
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<io_threads; i++) {
+        threads.emplace_back([&io_service] () {io_service.run();});
+    }
     io_service.run();
+    for (auto& x: threads) x.join();
 }
 #endif
@@ -0,0 +1,28 @@
+#ifndef CN_THREAD_POOL_H
+#define CN_THREAD_POOL_H
+#include <stddef.h>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+    void work();
+public:
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool(size_t threads);
+    ~ThreadPool();
+    size_t size() const;
+    void post(std::function<void()> task);
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn);
+    static ThreadPool& shared();
+};
+#endif
@@ -3,12 +3,13 @@
 #include <vector>
 #include <deque>
 #include "file.h"
+#include "scheduler.h"
 
 class BasicUI {
     void print_line(const std::string& line, bool keep=false);
 public:
     BasicUI(const std::vector<std::string>& header_lines);
-    void report_client_status(const std::unordered_map<address, ClientStatus>& clients);
+    void report_client_status(const std::unordered_map<size_t, ClientStatus>& clients, const Scheduler& scheduler);
     void report_status(const std::unordered_map<std::string, File>& files);
     void log(const std::string& message);
 };
@@ -20,7 +21,7 @@ class ANSIUI {
     std::deque<std::string> logs;
 public:
     ANSIUI(const std::vector<std::string>& header_lines);
-    void report_client_status(const std::unordered_map<address, ClientStatus>& clients);
+    void report_client_status(const std::unordered_map<size_t, ClientStatus>& clients, const Scheduler& scheduler);
     void report_status(const std::unordered_map<std::string, File>& files);
     void log(const std::string& message);
 };
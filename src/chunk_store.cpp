@@ -0,0 +1,212 @@
+#include "chunk_store.h"
+#include <string.h>
+#include <vector>
+#include <boost/filesystem.hpp>
+using namespace boost::filesystem;
+
+static const char store_magic[8] = {'C', 'N', 'S', 'T', 'O', 'R', 'E', '1'};
+// Below this many stale records the journal is not worth rewriting.
+static const size_t compact_slack = 4096;
+
+struct StoreRecord {
+    hash_t hash;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t last_used;
+};
+
+static_assert(sizeof(StoreRecord) == 48, "StoreRecord must be stored without padding");
+
+static StoreRecord make_record(const hash_t& hash, uint32_t size, uint64_t last_used) {
+    StoreRecord r = StoreRecord();
+    r.hash = hash;
+    r.size = size;
+    r.last_used = last_used;
+    return r;
+}
+
+static std::string to_hex(const uint8_t* data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string res;
+    for (size_t i=0; i<size; i++) {
+        res += digits[data[i] >> 4];
+        res += digits[data[i] & 15];
+    }
+    return res;
+}
+
+ChunkStore::ChunkStore(const std::string& dir, size_t quota):
+    dir(dir), quota(quota), total(0), clock(0), records(0), tmp_files(0), journal(nullptr) {
+    boost::system::error_code ec;
+    create_directories(dir, ec);
+    load();
+    remove_unknown_files();
+    compact();
+}
+
+ChunkStore::~ChunkStore() {
+    if (journal) fclose(journal);
+}
+
+std::string ChunkStore::chunk_path(const hash_t& hash) const {
+    const std::string& name = to_hex((const uint8_t*) &hash, sizeof(hash));
+    return dir + "/" + name.substr(0, 2) + "/" + name;
+}
+
+void ChunkStore::load() {
+    FILE* in = fopen((dir + "/index").c_str(), "rb");
+    if (!in) return;
+    char magic[sizeof(store_magic)];
+    if (fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, store_magic, sizeof(magic)) == 0) {
+        // A record cut short by a crash is dropped with everything after it.
+        StoreRecord x;
+        while (fread(&x, sizeof(x), 1, in) == 1) {
+            auto it = entries.find(x.hash);
+            if (it != entries.end()) {
+                total -= it->second.size;
+                by_use.erase(it->second.last_used);
+                entries.erase(it);
+            }
+            if (x.size) {
+                entries[x.hash] = {x.size, x.last_used};
+                by_use[x.last_used] = x.hash;
+                total += x.size;
+            }
+            clock = std::max(clock, x.last_used);
+        }
+    }
+    fclose(in);
+}
+
+void ChunkStore::remove_unknown_files() {
+    boost::system::error_code ec;
+    for (directory_iterator sub(dir, ec), end; !ec && sub != end; sub.increment(ec)) {
+        if (!is_directory(sub->status())) continue;
+        for (directory_iterator x(sub->path(), ec); !ec && x != end; x.increment(ec)) {
+            std::string name = x->path().filename().string();
+            bool known = false;
+            if (name.size() == 2 * sizeof(hash_t)) {
+                hash_t hash;
+                uint8_t* bytes = (uint8_t*) &hash;
+                for (size_t i=0; i<sizeof(hash_t); i++) bytes[i] = strtoul(name.substr(2*i, 2).c_str(), nullptr, 16);
+                known = entries.count(hash) && to_hex(bytes, sizeof(hash_t)) == name;
+            }
+            boost::system::error_code remove_ec;
+            if (!known) remove(x->path(), remove_ec);
+        }
+        ec.clear();
+    }
+}
+
+// Rewrites the journal with a single record for each chunk, and renames it
+// into place so that a crash leaves either the old or the new one.
+void ChunkStore::compact() {
+    if (journal) fclose(journal);
+    const std::string& path = dir + "/index";
+    const std::string& tmp_path = path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    bool ok = out && fwrite(store_magic, sizeof(store_magic), 1, out) == 1;
+    for (auto& x: by_use) {
+        const StoreRecord& r = make_record(x.second, entries.at(x.second).size, x.first);
+        ok = ok && fwrite(&r, sizeof(r), 1, out) == 1;
+    }
+    if (out) ok = fclose(out) == 0 && ok;
+    boost::system::error_code ec;
+    if (ok) rename(tmp_path, path, ec);
+    if (!ok || ec) remove(tmp_path, ec);
+    records = entries.size();
+    journal = fopen(path.c_str(), "ab");
+}
+
+void ChunkStore::record(const hash_t& hash, uint32_t size, uint64_t last_used) {
+    if (++records > 2 * entries.size() + compact_slack) {
+        compact();
+        return;
+    }
+    if (!journal) return;
+    const StoreRecord& r = make_record(hash, size, last_used);
+    fwrite(&r, sizeof(r), 1, journal);
+    fflush(journal);
+}
+
+void ChunkStore::touch(const hash_t& hash, Entry& entry) {
+    by_use.erase(entry.last_used);
+    entry.last_used = ++clock;
+    by_use[entry.last_used] = hash;
+    record(hash, entry.size, entry.last_used);
+}
+
+void ChunkStore::evict(const hash_t& hash) {
+    auto it = entries.find(hash);
+    if (it == entries.end()) return;
+    total -= it->second.size;
+    by_use.erase(it->second.last_used);
+    entries.erase(it);
+    boost::system::error_code ec;
+    remove(chunk_path(hash), ec);
+    record(hash, 0, 0);
+}
+
+// The file is read without holding the lock. If the chunk gets evicted in
+// the meantime, the read either fails or still sees the removed file.
+bool ChunkStore::get(const hash_t& hash, uint8_t* destination, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it == entries.end() || it->second.size != size) return false;
+    }
+    FILE* in = fopen(chunk_path(hash).c_str(), "rb");
+    bool ok = in && fread(destination, 1, size, in) == size && fgetc(in) == EOF;
+    if (in) fclose(in);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(hash);
+    if (!ok) {
+        if (it != entries.end()) evict(hash);
+        return false;
+    }
+    if (it != entries.end()) touch(hash, it->second);
+    return true;
+}
+
+void ChunkStore::put(const hash_t& hash, const Chunk& chunk) {
+    if (chunk.size == 0 || chunk.size > quota) return;
+    size_t tmp_no;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it != entries.end()) {
+            touch(hash, it->second);
+            return;
+        }
+        tmp_no = tmp_files++;
+    }
+    const std::string& path = chunk_path(hash);
+    const std::string& tmp_path = path + "." + std::to_string(tmp_no) + ".tmp";
+    boost::system::error_code ec;
+    create_directories(boost::filesystem::path(path).parent_path(), ec);
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    bool ok = out && fwrite(chunk.data, 1, chunk.size, out) == chunk.size;
+    if (out) ok = fclose(out) == 0 && ok;
+    std::lock_guard<std::mutex> lock(mutex);
+    // Another thread may have stored the same chunk meanwhile.
+    if (!ok || entries.count(hash)) {
+        remove(tmp_path, ec);
+        return;
+    }
+    while (total + chunk.size > quota && !by_use.empty()) evict(by_use.begin()->second);
+    rename(tmp_path, path, ec);
+    if (ec) {
+        remove(tmp_path, ec);
+        return;
+    }
+    Entry entry = {(uint32_t) chunk.size, ++clock};
+    entries[hash] = entry;
+    by_use[entry.last_used] = hash;
+    total += chunk.size;
+    record(hash, entry.size, entry.last_used);
+}
+
+void ChunkStore::discard(const hash_t& hash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    evict(hash);
+}
@@ -0,0 +1,98 @@
+#include "chunking.h"
+#include "thread_pool.h"
+#include <algorithm>
+
+static const size_t min_segment_size = 0x1000000;
+
+bool Chunking::valid() const {
+    if (max_size < 64 || max_size > chunk_size_limit) return false;
+    if (mode == fixed_chunking) return min_size == max_size && avg_size == max_size;
+    return mode == content_defined_chunking && min_size > 0 && avg_size >= 64 && min_size <= avg_size && avg_size <= max_size;
+}
+
+Chunking pick_chunking(chunking_mode mode, size_t chunk_size, uint64_t file_size) {
+    if (chunk_size == 0) {
+        chunk_size = min_picked_chunk_size;
+        while (chunk_size < max_picked_chunk_size && chunk_size * target_file_chunks < file_size) chunk_size *= 2;
+    }
+    if (mode == fixed_chunking) return Chunking(fixed_chunking, chunk_size, chunk_size, chunk_size);
+    return Chunking(content_defined_chunking, chunk_size / 4, chunk_size, std::min(chunk_size * 4, chunk_size_limit));
+}
+
+// The table is part of the format: files cut with another one would not
+// share chunks with what is already out there.
+static const uint64_t* gear_table() {
+    static const struct Table {
+        uint64_t values[256];
+        Table() {
+            uint64_t state = 0x636e2d6765617221;
+            for (auto& x: values) {
+                state += 0x9E3779B97F4A7C15;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+                x = z ^ (z >> 31);
+            }
+        }
+    } table;
+    return table.values;
+}
+
+// The hash at a position only depends on the 64 bytes up to it, so where the
+// masks are hit can be found for all of the data at once, in parallel, and
+// the cuts are then picked from those positions. Each one is stored as the
+// length of the data up to it, times two, plus one if the harder mask is hit.
+static void find_candidates(const uint8_t* data, size_t begin, size_t end, uint64_t hard_mask, uint64_t easy_mask,
+                            std::vector<uint64_t>& candidates) {
+    const uint64_t* gear = gear_table();
+    uint64_t hash = 0;
+    for (size_t i = begin < 64 ? 0 : begin - 64; i < begin; i++) {
+        hash = (hash << 1) + gear[data[i]];
+    }
+    for (size_t i=begin; i<end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if (hash & easy_mask) continue;
+        candidates.push_back((uint64_t)(i+1) << 1 | !(hash & hard_mask));
+    }
+}
+
+std::vector<uint32_t> cut_chunks(const uint8_t* data, size_t size, const Chunking& chunking) {
+    std::vector<uint32_t> sizes;
+    if (chunking.mode == fixed_chunking) {
+        for (size_t pos=0; pos<size; pos+=chunking.max_size) {
+            sizes.push_back(std::min<size_t>(chunking.max_size, size - pos));
+        }
+        return sizes;
+    }
+    unsigned bits = 0;
+    while (((size_t)2 << bits) <= chunking.avg_size) bits++;
+    const uint64_t hard_mask = ~(uint64_t)0 << (64 - (bits + 2));
+    const uint64_t easy_mask = ~(uint64_t)0 << (64 - (bits - 2));
+
+    const size_t part = std::max(min_segment_size, size / (4 * ThreadPool::shared().size()) + 1);
+    std::vector<std::vector<uint64_t>> candidates((size + part - 1) / part);
+    ThreadPool::shared().parallel_for(candidates.size(), [&] (size_t i) {
+        find_candidates(data, i*part, std::min(size, (i+1)*part), hard_mask, easy_mask, candidates[i]);
+    });
+
+    std::vector<uint64_t> all;
+    for (auto& x: candidates) all.insert(all.end(), x.begin(), x.end());
+
+    size_t next = 0;
+    for (size_t start=0; start<size;) {
+        size_t end = std::min<size_t>(size, start + chunking.max_size);
+        size_t cut = end;
+        if (size - start > chunking.min_size) {
+            while (next < all.size() && (all[next] >> 1) < start + chunking.min_size) next++;
+            for (size_t i=next; i<all.size() && (all[i] >> 1) < end; i++) {
+                if ((all[i] & 1) || (all[i] >> 1) >= start + chunking.avg_size) {
+                    cut = all[i] >> 1;
+                    break;
+                }
+            }
+        }
+        sizes.push_back(cut - start);
+        start = cut;
+    }
+    return sizes;
+}
@@ -1,13 +1,11 @@
 #include "common.h"
 #include "hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
 
-hash_t::hash_t(tcp::socket& socket, boost::asio::yield_context yield) {
-    boost::asio::async_read(socket, boost::asio::buffer(&weak_hash, 4), yield);
-    boost::asio::async_read(socket, boost::asio::buffer(strong_hash), yield);
-}
-
 void hash_t::add_buffers(std::vector<boost::asio::const_buffer>& buffers) const {
     buffers.emplace_back(&weak_hash, 4);
     buffers.emplace_back(&strong_hash[0], 28);
@@ -20,7 +18,46 @@ void hash_t::print() const {
 }
 
 hash_t Chunk::get_hash() const {
-    Hasher hasher(chunk_max_size);
-    hasher.update(data, data+size);
-    return hasher.get_strong_hash();
+    return get_block_hash(data, data+size);
+}
+
+bool parse_client_options(int argc, char** argv, ClientOptions& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:d:t:zM:S:Q:")) != -1) {
+        switch (opt) {
+            case 'u':
+                options.upload_slots = atol(optarg);
+                break;
+            case 'd':
+                options.download_slots = atol(optarg);
+                break;
+            case 't':
+                options.io_threads = atol(optarg);
+                break;
+            case 'z':
+                options.compress = true;
+                break;
+            case 'M':
+                options.multicast_group = address::from_string(optarg);
+                break;
+            case 'S':
+                options.store_dir = optarg;
+                break;
+            case 'Q':
+                options.store_quota = (size_t)atol(optarg) << 20;
+                break;
+            default:
+                optind = argc;
+        }
+    }
+    if (argc - optind < 3) {
+        fprintf(stderr, "Usage: %s [-u upload_slots] [-d download_slots] [-t io_threads] [-z] [-M multicast_group] [-S store_dir [-Q store_quota_mib]] server_ip base_dir file [file [file ...]]\n", argv[0]);
+        return false;
+    }
+    options.server_ip = address::from_string(argv[optind]);
+    options.base_dir = argv[optind+1];
+    for (int i=optind+2; i<argc; i++) {
+        options.files.push_back(argv[i]);
+    }
+    return true;
 }
@@ -1,85 +1,269 @@
 #include "communication.h"
 #include "common.h"
 #include <string.h>
+#include <algorithm>
+#include <stdexcept>
 
-static uint32_t read_uint32_t(tcp::socket& socket, boost::asio::yield_context yield) {
+// The hashes are laid out in memory exactly as they go on the wire, so a
+// list of them is read and written as one buffer.
+static_assert(sizeof(hash_t) == 32, "hash_t must match its wire format");
+
+void PacketReader::fill(size_t bytes, boost::asio::yield_context yield) {
+    if (end - begin >= bytes) return;
+    if (buffer.size() - begin < bytes) {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        frame_end = 0;
+        begin = 0;
+        if (buffer.size() < bytes) buffer.resize(bytes);
+    }
+    while (end - begin < bytes) {
+        end += socket.async_read_some(boost::asio::buffer(buffer.data() + end, buffer.size() - end), yield);
+    }
+}
+
+// A frame is always buffered whole, so whatever a packet did not decode of
+// it is simply skipped.
+packet_type PacketReader::next(boost::asio::yield_context yield) {
+    begin = std::max(begin, frame_end);
+    fill(4, yield);
+    uint32_t netlength;
+    memcpy(&netlength, buffer.data() + begin, 4);
+    size_t length = ntohl(netlength);
+    if (length < 1 || length > max_frame_size) throw std::runtime_error("Invalid frame length");
+    begin += 4;
+    fill(length, yield);
+    frame_end = begin + length;
+    return (packet_type) get_uint8();
+}
+
+void PacketReader::get(void* out, size_t size) {
+    if (frame_end - begin < size) throw std::runtime_error("Truncated packet");
+    memcpy(out, buffer.data() + begin, size);
+    begin += size;
+}
+
+uint8_t PacketReader::get_uint8() {
+    uint8_t val;
+    get(&val, 1);
+    return val;
+}
+
+uint32_t PacketReader::get_uint32() {
     uint32_t netval;
-    boost::asio::async_read(socket, boost::asio::buffer(&netval, 4), yield);
+    get(&netval, 4);
     return ntohl(netval);
 }
 
-static std::string read_string(tcp::socket& socket, boost::asio::yield_context yield) {
-    size_t size = read_uint32_t(socket, yield);
-    std::string str;
-    str.resize(size);
-    boost::asio::async_read(socket, boost::asio::buffer(&str[0], size), yield);
+uint64_t PacketReader::get_uint64() {
+    uint64_t netval;
+    get(&netval, 8);
+    return be64toh(netval);
+}
+
+hash_t PacketReader::get_hash() {
+    hash_t hash;
+    get(&hash, sizeof(hash_t));
+    return hash;
+}
+
+std::string PacketReader::get_string() {
+    size_t size = get_uint32();
+    if (frame_end - begin < size) throw std::runtime_error("Truncated packet");
+    std::string str((const char*) buffer.data() + begin, size);
+    begin += size;
     return str;
 }
 
-ChunkDataPacket::ChunkDataPacket(const uint8_t* ptr, size_t size) {
-    data.resize(size);
-    memcpy(&data[0], ptr, size);
+void PacketReader::get_hashes(std::vector<hash_t>& hashes) {
+    size_t count = get_uint32();
+    if ((frame_end - begin) / sizeof(hash_t) < count) throw std::runtime_error("Truncated packet");
+    hashes.resize(count);
+    get(hashes.data(), count * sizeof(hash_t));
+}
+
+// Only the part of the payload that was already buffered is copied; the
+// rest is read straight into the destination.
+void PacketReader::read_payload(boost::asio::yield_context yield, uint8_t* destination, size_t size) {
+    begin = std::max(begin, frame_end);
+    size_t buffered = std::min(size, end - begin);
+    memcpy(destination, buffer.data() + begin, buffered);
+    begin += buffered;
+    frame_end = begin;
+    if (buffered < size) {
+        boost::asio::async_read(socket, boost::asio::buffer(destination + buffered, size - buffered), yield);
+    }
 }
 
-ChunkDataPacket::ChunkDataPacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    uint32_t size = read_uint32_t(socket, yield);
-    data.resize(size);
-    boost::asio::async_read(socket, boost::asio::buffer(&data[0], size), yield);
+RelayList::RelayList(PacketReader& reader) {
+    count = reader.get_uint8();
+    for (size_t i=0; i<count; i++) {
+        peers.push_back(reader.get_uint32());
+    }
 }
 
-/*
-hash_t ChunkDataPacket::get_hash() const {
-    Hasher hasher(chunk_max_size);
-    hasher.update(data.begin(), data.end());
-    return hasher.get_strong_hash();
+void RelayList::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    if (peers.size() > 255) throw std::runtime_error("Relay chain too long");
+    count = peers.size();
+    netids.clear();
+    for (auto x: peers) netids.push_back(htonl(x));
+    buffers.emplace_back(&count, 1);
+    if (count) buffers.emplace_back(&netids[0], 4 * count);
+}
+
+ChunkDataPacket::ChunkDataPacket(PacketReader& reader): received(0), hash(reader.get_hash()), chunk((size_t)0, nullptr) {
+    encoding = (chunk_encoding) reader.get_uint8();
+    size = reader.get_uint32();
+    chunk.size = reader.get_uint32();
+    relays = RelayList(reader);
+}
+
+ChunkFramePacket::ChunkFramePacket(PacketReader& reader): data((size_t)0, nullptr) {
+    offset = reader.get_uint32();
+    data.size = reader.get_uint32();
+}
+
+void ChunkFramePacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netoffset = htonl(offset);
+    netsize = htonl(data.size);
+    buffers.emplace_back(&netoffset, 4);
+    buffers.emplace_back(&netsize, 4);
+}
+
+void ChunkFramePacket::add_payload(std::vector<boost::asio::const_buffer>& buffers) {
+    buffers.emplace_back(data.data, data.size);
+}
+
+// Frames arrive in order, each one right after the previous.
+ChunkFramePacket ChunkDataPacket::read_frame(PacketReader& reader, boost::asio::yield_context yield, uint8_t* destination) {
+    if (reader.next(yield) != chunk_frame) throw std::runtime_error("Expected a chunk frame");
+    ChunkFramePacket frame(reader);
+    if (frame.offset != received || frame.data.size == 0 || frame.data.size > chunk.size - received) {
+        throw std::runtime_error("Invalid chunk frame");
+    }
+    reader.read_payload(yield, destination + frame.offset, frame.data.size);
+    frame.data.data = destination + frame.offset;
+    received += frame.data.size;
+    chunk.data = destination;
+    return frame;
+}
+
+void ChunkDataPacket::read_data(PacketReader& reader, boost::asio::yield_context yield, uint8_t* destination) {
+    while (!complete()) read_frame(reader, yield, destination);
+    chunk.data = destination;
 }
-*/
 
 void ChunkDataPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
-    netlength = htonl(data.size());
+    hash.add_buffers(buffers);
+    buffers.emplace_back(&encoding, 1);
+    netsize = htonl(size);
+    buffers.emplace_back(&netsize, 4);
+    netlength = htonl(chunk.size);
     buffers.emplace_back(&netlength, 4);
-    buffers.emplace_back(&data[0], data.size());
+    relays.add_buffers(buffers);
+}
+
+void ChunkDataPacket::add_payload(std::vector<boost::asio::const_buffer>& buffers) {
+    size_t count = (chunk.size + chunk_frame_size - 1) / chunk_frame_size;
+    frames.clear();
+    frames.reserve(count);
+    frame_headers.resize(count);
+    for (size_t i=0; i<count; i++) {
+        size_t offset = i * chunk_frame_size;
+        frames.emplace_back(offset, Chunk(std::min(chunk_frame_size, chunk.size - offset), chunk.data + offset));
+        frame_packet(frames.back(), frame_headers[i].first, frame_headers[i].second, buffers);
+    }
 }
 
 Chunk ChunkDataPacket::get_chunk() const {
-    return {data.size(), &data[0]};
+    return chunk;
 }
 
-ChunkListPacket::ChunkListPacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    size_t size = read_uint32_t(socket, yield);
-    for (size_t i=0; i<size; i++) {
-        chunks.emplace_back(socket, yield);
-    }
+ChunkListPacket::ChunkListPacket(PacketReader& reader) {
+    reader.get_hashes(chunks);
 }
 
 void ChunkListPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
     netlength = htonl(chunks.size());
     buffers.emplace_back(&netlength, 4);
-    for (auto& chunk: chunks) {
-        chunk.add_buffers(buffers);
-    }
+    buffers.emplace_back(chunks.data(), chunks.size() * sizeof(hash_t));
 }
 
 void NewChunkPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
     chunk.add_buffers(buffers);
 }
 
-SendChunkPacket::SendChunkPacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    receiver_str = read_string(socket, yield);
-    receiver = address::from_string(receiver_str);
-    chunk = hash_t(socket, yield);
+NewChunksPacket::NewChunksPacket(PacketReader& reader) {
+    reader.get_hashes(chunks);
 }
 
-void SendChunkPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
-    receiver_str = receiver.to_string();
-    netlength = htonl(receiver_str.size());
+void NewChunksPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netlength = htonl(chunks.size());
     buffers.emplace_back(&netlength, 4);
-    buffers.emplace_back(&receiver_str[0], receiver_str.size());
+    buffers.emplace_back(chunks.data(), chunks.size() * sizeof(hash_t));
+}
+
+PeerInfoPacket::PeerInfoPacket(PacketReader& reader) {
+    id = reader.get_uint32();
+    addr_str = reader.get_string();
+    addr = address::from_string(addr_str);
+}
+
+void PeerInfoPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    addr_str = addr.to_string();
+    netid = htonl(id);
+    netlength = htonl(addr_str.size());
+    buffers.emplace_back(&netid, 4);
+    buffers.emplace_back(&netlength, 4);
+    buffers.emplace_back(&addr_str[0], addr_str.size());
+}
+
+SendChunkPacket::SendChunkPacket(PacketReader& reader) {
+    receiver = reader.get_uint32();
+    chunk = reader.get_hash();
+    relays = RelayList(reader);
+}
+
+void SendChunkPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netreceiver = htonl(receiver);
+    buffers.emplace_back(&netreceiver, 4);
+    chunk.add_buffers(buffers);
+    relays.add_buffers(buffers);
+}
+
+TransferFailedPacket::TransferFailedPacket(PacketReader& reader) {
+    receiver = reader.get_uint32();
+    chunk = reader.get_hash();
+}
+
+void TransferFailedPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netreceiver = htonl(receiver);
+    buffers.emplace_back(&netreceiver, 4);
     chunk.add_buffers(buffers);
 }
 
-GetFilePacket::GetFilePacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    name = read_string(socket, yield);
+NackPacket::NackPacket(PacketReader& reader) {
+    name = reader.get_string();
+    round = reader.get_uint32();
+    count = reader.get_uint32();
+    if (count > max_frame_size * 8) throw std::runtime_error("NACK bitmap too long");
+    missing.resize((count+7)/8);
+    reader.get(missing.data(), missing.size());
+}
+
+void NackPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netlength = htonl(name.size());
+    netround = htonl(round);
+    netcount = htonl(count);
+    buffers.emplace_back(&netlength, 4);
+    buffers.emplace_back(&name[0], name.size());
+    buffers.emplace_back(&netround, 4);
+    buffers.emplace_back(&netcount, 4);
+    buffers.emplace_back(missing.data(), missing.size());
+}
+
+GetFilePacket::GetFilePacket(PacketReader& reader) {
+    name = reader.get_string();
 }
 
 void GetFilePacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
@@ -88,24 +272,59 @@ void GetFilePacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers)
     buffers.emplace_back(&name[0], name.size());
 }
 
-FileInfoPacket::FileInfoPacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    name = read_string(socket, yield);
-    boost::asio::async_read(socket, boost::asio::buffer(&netfsize, 8), yield);
-    size = be64toh(netfsize);
-    chunk_list = ChunkListPacket(socket, yield);
+FileInfoPacket::FileInfoPacket(PacketReader& reader) {
+    name = reader.get_string();
+    size = reader.get_uint64();
+    chunking.mode = (chunking_mode) reader.get_uint8();
+    chunking.min_size = reader.get_uint32();
+    chunking.avg_size = reader.get_uint32();
+    chunking.max_size = reader.get_uint32();
+    if (!chunking.valid()) throw std::runtime_error("Invalid chunking");
+    chunk_list = ChunkListPacket(reader);
+    if (chunking.mode == fixed_chunking) {
+        chunk_sizes = cut_chunks(nullptr, size, chunking);
+    } else {
+        chunk_sizes.resize(chunk_list.chunks.size());
+        for (auto& x: chunk_sizes) x = reader.get_uint32();
+    }
+    uint64_t total = 0;
+    for (auto x: chunk_sizes) total += x;
+    if (chunk_sizes.size() != chunk_list.chunks.size() || total != size) throw std::runtime_error("Invalid chunk sizes");
 }
 
 void FileInfoPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
     netlength = htonl(name.size());
     netfsize = htobe64(size);
+    mode = chunking.mode;
+    netchunking[0] = htonl(chunking.min_size);
+    netchunking[1] = htonl(chunking.avg_size);
+    netchunking[2] = htonl(chunking.max_size);
     buffers.emplace_back(&netlength, 4);
     buffers.emplace_back(&name[0], name.size());
     buffers.emplace_back(&netfsize, 8);
+    buffers.emplace_back(&mode, 1);
+    buffers.emplace_back(netchunking, sizeof(netchunking));
     chunk_list.add_buffers(buffers);
+    if (chunking.mode == fixed_chunking) return;
+    netsizes.resize(chunk_sizes.size());
+    for (size_t i=0; i<chunk_sizes.size(); i++) netsizes[i] = htonl(chunk_sizes[i]);
+    buffers.emplace_back(netsizes.data(), netsizes.size() * sizeof(uint32_t));
+}
+
+SlotsPacket::SlotsPacket(PacketReader& reader) {
+    upload = reader.get_uint32();
+    download = reader.get_uint32();
 }
 
-ErrorPacket::ErrorPacket(tcp::socket& socket, boost::asio::yield_context yield) {
-    boost::asio::async_read(socket, boost::asio::buffer(&code, 1), yield);
+void SlotsPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
+    netupload = htonl(upload);
+    netdownload = htonl(download);
+    buffers.emplace_back(&netupload, 4);
+    buffers.emplace_back(&netdownload, 4);
+}
+
+ErrorPacket::ErrorPacket(PacketReader& reader) {
+    code = (error_code) reader.get_uint8();
 }
 
 void ErrorPacket::add_buffers(std::vector<boost::asio::const_buffer>& buffers) {
@@ -122,9 +341,3 @@ const std::string ErrorPacket::get_as_string() const {
             return "Unknown error code!";
     };
 }
-
-packet_type get_packet_type(tcp::socket& socket, boost::asio::yield_context yield) {
-    packet_type type;
-    boost::asio::async_read(socket, boost::asio::buffer(&type, 1), yield);
-    return type;
-}
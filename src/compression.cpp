@@ -0,0 +1,54 @@
+#include "compression.h"
+#include <zlib.h>
+
+bool compress_chunk(const Chunk& chunk, std::vector<uint8_t>& out) {
+    uLongf size = compressBound(chunk.size);
+    out.resize(size);
+    if (compress2(&out[0], &size, chunk.data, chunk.size, Z_BEST_SPEED) != Z_OK) return false;
+    if (size > chunk.size - chunk.size / 8) return false;
+    out.resize(size);
+    out.shrink_to_fit();
+    return true;
+}
+
+bool decompress_chunk(const Chunk& compressed, uint8_t* out, size_t size) {
+    uLongf out_size = size;
+    if (uncompress(out, &out_size, compressed.data, compressed.size) != Z_OK) return false;
+    return out_size == size;
+}
+
+size_t max_encoded_size(size_t size) {
+    return compressBound(size);
+}
+
+size_t CompressionCache::cost(const entry_t& data) {
+    return sizeof(Entry) + sizeof(hash_t) + (data ? data->size() : 0);
+}
+
+CompressionCache::entry_t CompressionCache::get(const hash_t& hash, const Chunk& chunk) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(hash);
+        if (it != entries.end()) {
+            lru.splice(lru.begin(), lru, it->second.position);
+            return it->second.data;
+        }
+    }
+    // Compressed without the lock; two senders missing on the same chunk
+    // at once both compress it, and the second result is dropped.
+    std::shared_ptr<std::vector<uint8_t>> compressed = std::make_shared<std::vector<uint8_t>>();
+    entry_t data;
+    if (compress_chunk(chunk, *compressed)) data = compressed;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entries.count(hash)) return data;
+    lru.push_front(hash);
+    entries[hash] = {data, lru.begin()};
+    used += cost(data);
+    while (used > capacity && !lru.empty()) {
+        auto old = entries.find(lru.back());
+        used -= cost(old->second.data);
+        entries.erase(old);
+        lru.pop_back();
+    }
+    return data;
+}
@@ -1,7 +1,11 @@
 #include "file.h"
 #include "hash.h"
+#include "thread_pool.h"
 #include <boost/filesystem.hpp>
 #include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
 using namespace boost::filesystem;
 
 File::File(const std::string& path, size_t resize) {
@@ -23,68 +27,276 @@ size_t File::size() const {
     return file.size();
 }
 
-void File::write_chunk(Chunk data, const hash_t& hash, const std::unordered_set<uint8_t*>& skip) {
-    for (auto x: chunk_positions[hash]) {
-        if (skip.count(x)) continue;
-        memcpy(x, data.data, data.size);
-    }
-    present_chunks.insert(hash);
+std::vector<uint32_t> File::get_chunk_sizes(const Chunking& chunking) const {
+    return cut_chunks(data, size(), chunking);
 }
 
-std::vector<hash_t> File::get_chunk_list() const {
-    std::vector<hash_t> hashes;
-    for (uint8_t* ptr=data; ptr<data+size(); ptr += chunk_max_size) {
-        Chunk chunk(ptr, std::min(ptr+chunk_max_size, data+size()));
-        hashes.push_back(chunk.get_hash());
+std::vector<hash_t> File::get_chunk_list(const std::vector<uint32_t>& sizes) const {
+    std::vector<hash_t> hashes(sizes.size());
+    std::vector<size_t> starts(sizes.size());
+    for (size_t i=1; i<sizes.size(); i++) starts[i] = starts[i-1] + sizes[i-1];
+    // Runs of chunks with the same length, as all full ones are with fixed
+    // chunking, are handed out in groups that a multi-buffer SHA backend can
+    // hash together.
+    const size_t lanes = SHA224::lanes();
+    std::vector<size_t> groups;
+    for (size_t i=0; i<sizes.size(); i++) {
+        if (groups.empty() || i - groups.back() == lanes || sizes[i] != sizes[groups.back()]) groups.push_back(i);
     }
+    groups.push_back(sizes.size());
+    ThreadPool::shared().parallel_for(groups.size() - 1, [this, &hashes, &sizes, &starts, &groups] (size_t group) {
+        size_t first = groups[group];
+        size_t count = groups[group+1] - first;
+        std::vector<const uint8_t*> blocks(count);
+        for (size_t i=0; i<count; i++) blocks[i] = data + starts[first + i];
+        get_block_hashes(blocks.data(), sizes[first], count, &hashes[first]);
+    });
     return hashes;
 }
 
+void File::set_positions(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes) {
+    offsets.assign(1, 0);
+    for (auto x: sizes) offsets.push_back(offsets.back() + x);
+    for (size_t i=0; i<chunks.size(); i++) {
+        chunk_positions[chunks[i]].push_back(data + offsets[i]);
+    }
+}
+
+size_t File::chunk_size_at(const uint8_t* position) const {
+    size_t offset = position - data;
+    return *std::upper_bound(offsets.begin(), offsets.end(), offset) - offset;
+}
+
 Chunk File::get_chunk_data(const hash_t& hash) const {
     for (auto x: chunk_positions.at(hash)) {
-        return {x, std::min(x+chunk_max_size, data+size())};
+        return {x, x + chunk_size_at(x)};
     }
     return {(size_t)0, nullptr};
 }
 
-void File::write_chunk(Chunk data, const hash_t& hash) {
-    write_chunk(data, hash, std::unordered_set<uint8_t*>());
+// Where the data of a chunk can be received in place; copy_chunk with the
+// data already there then only fills the other positions.
+uint8_t* File::get_chunk_destination(const hash_t& hash) {
+    return chunk_positions.at(hash)[0];
 }
 
-void File::set_chunks_from_list(const std::vector<hash_t>& chunks) {
-    for (size_t i=0; i<chunks.size(); i++) {
-        chunk_positions[chunks[i]].push_back(data+chunk_max_size*i);
+// Only touches the mapped data, so it may run off the io thread as long as
+// nothing else writes to the positions of this chunk.
+void File::copy_chunk(Chunk data, const hash_t& hash) {
+    for (auto x: chunk_positions.at(hash)) {
+        if (x == data.data) continue;
+        memcpy(x, data.data, data.size);
+    }
+}
+
+void File::set_chunk_present(const hash_t& hash) {
+    present_chunks.insert(hash);
+}
+
+namespace {
+// Weak hashes of the chunks still looked for, behind a bitmap so that most
+// positions are rejected without searching the table.
+class WeakHashFilter {
+    std::vector<uint64_t> bits;
+    unsigned shift;
+    std::vector<std::pair<uint32_t, size_t>> table;
+    size_t slot(uint32_t weak) const {
+        return (uint32_t)(weak * 0x9E3779B1u) >> shift;
     }
-    const auto& old_chunks = get_chunk_list();
-    if (chunks == old_chunks) {
-        for (auto& hash: chunks) {
-            present_chunks.insert(hash);
+public:
+    WeakHashFilter(const std::vector<hash_t>& chunks) {
+        unsigned log = 16;
+        while (log < 28 && ((size_t)1 << log) < chunks.size() * 16) log++;
+        shift = 32 - log;
+        bits.resize(((size_t)1 << log) / 64);
+        for (size_t i=0; i<chunks.size(); i++) {
+            size_t s = slot(chunks[i].weak_hash);
+            bits[s / 64] |= (uint64_t)1 << (s % 64);
+            table.emplace_back(chunks[i].weak_hash, i);
         }
-        return;
+        std::sort(table.begin(), table.end());
     }
-    std::unordered_map<hash_t, std::unordered_set<uint8_t*>> already_present;
-    for (size_t i=0; i<old_chunks.size(); i++) {
-        already_present[old_chunks[i]].insert(data+chunk_max_size*i);
+    bool may_contain(uint32_t weak) const {
+        size_t s = slot(weak);
+        return (bits[s / 64] >> (s % 64)) & 1;
     }
-    std::unordered_set<uint32_t> weak_needed;
-    for (auto& x: chunks) {
-        weak_needed.insert(x.weak_hash);
+    std::vector<std::pair<uint32_t, size_t>>::const_iterator find(uint32_t weak) const {
+        return std::lower_bound(table.begin(), table.end(), std::make_pair(weak, (size_t)0));
     }
-    for (size_t pos=0; pos<size(); pos++) {
-        Hasher hasher(chunk_max_size);
-        hasher.update(data+pos, std::min(data+pos+chunk_max_size, data+size()));
-        pos += chunk_max_size;
-        while (pos < size() && (!weak_needed.count(hasher.get_weak_hash()) || !chunk_positions.count(hasher.get_strong_hash()))) {
-            hasher.update(data+pos, data+pos+1);
-            pos++;
+    std::vector<std::pair<uint32_t, size_t>>::const_iterator end() const {
+        return table.end();
+    }
+};
+
+struct Match {
+    size_t chunk;
+    size_t offset;
+};
+
+// Looks for the wanted chunks of size n at every chunk start position in
+// [begin, end), rolling the weak hash one byte at a time. The strong hash
+// is only computed on a weak hit for a chunk that nobody has found yet.
+void scan_for_chunks(const uint8_t* data, size_t n, size_t begin, size_t end, const std::vector<hash_t>& wanted,
+        const WeakHashFilter& filter, std::atomic<bool>* found, std::vector<Match>& matches) {
+    uint32_t out_mult = 1;
+    for (size_t i=1; i<n; i++) out_mult *= MULTIPLIER;
+    size_t pos = begin;
+    uint32_t weak = get_block_weak_hash(data+pos, data+pos+n);
+    for (;;) {
+        bool matched = false;
+        if (filter.may_contain(weak)) {
+            auto first = filter.find(weak);
+            bool open = false;
+            for (auto it = first; it != filter.end() && it->first == weak; it++) {
+                if (!found[it->second].load(std::memory_order_relaxed)) open = true;
+            }
+            if (open) {
+                SHA224 strong_hash;
+                strong_hash.update(data+pos, data+pos+n);
+                sha224_t strong = strong_hash.get();
+                for (auto it = first; it != filter.end() && it->first == weak; it++) {
+                    if (!(wanted[it->second].strong_hash == strong)) continue;
+                    matched = true;
+                    if (!found[it->second].exchange(true)) matches.push_back({it->second, pos});
+                }
+            }
         }
-        if (chunk_positions.count(hasher.get_strong_hash())) {
-            write_chunk(hasher.get_chunk(), hasher.get_strong_hash(), already_present[hasher.get_strong_hash()]);
-            weak_needed.erase(hasher.get_weak_hash());
-            pos -= chunk_max_size;
+        pos += matched ? n : 1;
+        if (pos >= end) return;
+        if (matched) {
+            weak = get_block_weak_hash(data+pos, data+pos+n);
+        } else {
+            weak = (weak - out_mult * data[pos-1]) * MULTIPLIER + data[pos-1+n];
         }
     }
 }
+}
+
+// Chunks found anywhere in the old contents are copied to the positions
+// that need them. With fixed chunking they are looked for at every offset;
+// with content-defined chunking the old contents are cut the same way, and
+// only the chunks that gives are looked at. Copies go in increasing target
+// order; a source that is about to be overwritten before its last copy is
+// kept in memory first.
+size_t File::set_chunks_from_list(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes, const Chunking& chunking) {
+    set_positions(chunks, sizes);
+    auto chunk_index = [this] (size_t offset) {
+        return std::upper_bound(offsets.begin(), offsets.end(), offset) - offsets.begin() - 1;
+    };
+    size_t reused = 0;
+    std::vector<bool> in_place(chunks.size());
+    std::vector<hash_t> sources;
+    std::vector<size_t> source_offsets;
+    if (chunking.mode == fixed_chunking) {
+        const size_t n = chunking.max_size;
+        const auto& old_chunks = get_chunk_list(sizes);
+        std::unordered_map<hash_t, size_t> in_place_offset;
+        for (size_t i=0; i<chunks.size(); i++) {
+            if (!(chunks[i] == old_chunks[i])) continue;
+            in_place[i] = true;
+            in_place_offset.emplace(chunks[i], offsets[i]);
+            present_chunks.insert(chunks[i]);
+            reused += sizes[i];
+        }
+
+        std::vector<hash_t> wanted;
+        for (auto& x: chunk_positions) {
+            auto it = in_place_offset.find(x.first);
+            if (it != in_place_offset.end()) {
+                sources.push_back(x.first);
+                source_offsets.push_back(it->second);
+            } else if (x.second.front() + n <= data + size()) {
+                wanted.push_back(x.first);
+            }
+        }
+        if (!wanted.empty() && size() >= n) {
+            WeakHashFilter filter(wanted);
+            std::unique_ptr<std::atomic<bool>[]> found(new std::atomic<bool>[wanted.size()]());
+            const size_t starts = size() - n + 1;
+            const size_t part = std::max(16*n, starts / (4 * ThreadPool::shared().size()) + 1);
+            std::vector<std::vector<Match>> matches((starts + part - 1) / part);
+            ThreadPool::shared().parallel_for(matches.size(), [&] (size_t i) {
+                scan_for_chunks(data, n, i*part, std::min(starts, (i+1)*part), wanted, filter, found.get(), matches[i]);
+            });
+            for (auto& x: matches) {
+                for (auto& m: x) {
+                    sources.push_back(wanted[m.chunk]);
+                    source_offsets.push_back(m.offset);
+                }
+            }
+        }
+    } else {
+        const auto& old_sizes = get_chunk_sizes(chunking);
+        const auto& old_chunks = get_chunk_list(old_sizes);
+        std::unordered_set<hash_t> found;
+        size_t offset = 0;
+        for (size_t i=0; i<old_chunks.size(); offset += old_sizes[i++]) {
+            auto it = chunk_positions.find(old_chunks[i]);
+            if (it == chunk_positions.end()) continue;
+            for (auto x: it->second) {
+                if (x != data + offset) continue;
+                in_place[chunk_index(offset)] = true;
+                present_chunks.insert(old_chunks[i]);
+                reused += old_sizes[i];
+            }
+            if (!found.insert(old_chunks[i]).second) continue;
+            sources.push_back(old_chunks[i]);
+            source_offsets.push_back(offset);
+        }
+    }
+
+    // No chunk but the last of a file is shorter than min_size, so a chunk
+    // overlaps the slots of that size that it starts and ends in and those
+    // in between.
+    const size_t slot = chunking.min_size;
+    std::vector<std::pair<size_t, size_t>> copies;
+    std::vector<size_t> remaining(sources.size());
+    std::vector<size_t> source_sizes(sources.size());
+    std::unordered_map<size_t, std::vector<size_t>> sources_in_slot;
+    for (size_t s=0; s<sources.size(); s++) {
+        const auto& positions = chunk_positions[sources[s]];
+        for (auto x: positions) {
+            if (in_place[chunk_index(x - data)]) continue;
+            copies.emplace_back(x - data, s);
+            remaining[s]++;
+        }
+        if (!remaining[s]) continue;
+        source_sizes[s] = chunk_size_at(positions.front());
+        for (size_t i=source_offsets[s]/slot; i<=(source_offsets[s] + source_sizes[s] - 1)/slot; i++) {
+            sources_in_slot[i].push_back(s);
+        }
+        present_chunks.insert(sources[s]);
+    }
+    std::sort(copies.begin(), copies.end());
+    std::vector<std::vector<uint8_t>> kept(sources.size());
+    for (auto& x: copies) {
+        size_t target = x.first;
+        size_t s = x.second;
+        size_t len = source_sizes[s];
+        for (size_t i=target/slot; i<=(target + len - 1)/slot; i++) {
+            auto it = sources_in_slot.find(i);
+            if (it == sources_in_slot.end()) continue;
+            for (auto other: it->second) {
+                if (!remaining[other] || !kept[other].empty()) continue;
+                if (other == s && remaining[s] == 1) continue;
+                if (source_offsets[other] >= target + len || source_offsets[other] + source_sizes[other] <= target) continue;
+                kept[other].assign(data + source_offsets[other], data + source_offsets[other] + source_sizes[other]);
+            }
+        }
+        const uint8_t* from = kept[s].empty() ? data + source_offsets[s] : kept[s].data();
+        memmove(data + target, from, len);
+        reused += len;
+        if (--remaining[s] == 0) std::vector<uint8_t>().swap(kept[s]);
+    }
+    return reused;
+}
+
+// For a chunk list known to describe the current contents, e.g. one just
+// computed by get_chunk_list().
+void File::set_chunks_present(const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes) {
+    set_positions(chunks, sizes);
+    present_chunks.insert(chunks.begin(), chunks.end());
+}
 
 const std::unordered_set<hash_t>& File::get_present_chunks() const {
     return present_chunks;
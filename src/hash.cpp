@@ -2,16 +2,18 @@
 #include <string.h>
 #include <endian.h>
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+static const uint32_t sha224_iv[8] = {
+    0xC1059ED8, 0x367CD507, 0x3070DD17, 0xF70E5939,
+    0xFFC00B31, 0x68581511, 0x64F98FA7, 0xBEFA4FA4
+};
 
 SHA224::SHA224() {
-    hash[0] = 0xC1059ED8;
-    hash[1] = 0x367CD507;
-    hash[2] = 0x3070DD17;
-    hash[3] = 0xF70E5939;
-    hash[4] = 0xFFC00B31;
-    hash[5] = 0x68581511;
-    hash[6] = 0x64F98FA7;
-    hash[7] = 0xBEFA4FA4;
+    memcpy(hash, sha224_iv, sizeof(hash));
     total_len = 0;
     buff_used = 0;
 }
@@ -36,7 +38,7 @@ SHA224::SHA224() {
     H = temp1 + temp2; \
 }
 
-void SHA224::process(const uint8_t* start, const uint8_t* end) {
+static void process_scalar(uint32_t* hash, const uint8_t* start, const uint8_t* end) {
     register uint32_t a, b, c, d, e, f, g, h;
     uint32_t temp1, temp2, tm;
     uint32_t w[16];
@@ -49,7 +51,6 @@ void SHA224::process(const uint8_t* start, const uint8_t* end) {
     f = hash[5];
     g = hash[6];
     h = hash[7];
-    total_len += end-start;
     while (start < end) {
         for (i=0; i<16; i++) {
             w[i] = start[0]<<24 | start[1]<<16 | start[2]<<8 | start[3];
@@ -130,6 +131,341 @@ void SHA224::process(const uint8_t* start, const uint8_t* end) {
     }
 }
 
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Appends the padding and length of a len byte message whose last
+// len % 64 bytes are tail, and returns the number of blocks written.
+static size_t pad_tail(uint8_t* out, const uint8_t* tail, uint64_t len) {
+    size_t rem = len % 64;
+    size_t blocks = rem < 56 ? 1 : 2;
+    memcpy(out, tail, rem);
+    out[rem] = 0x80;
+    memset(out + rem + 1, 0, blocks*64 - rem - 1 - sizeof(uint64_t));
+    uint64_t bits = htobe64(len*8);
+    memcpy(out + blocks*64 - sizeof(uint64_t), &bits, sizeof(uint64_t));
+    return blocks;
+}
+
+static sha224_t state_to_digest(const uint32_t* state) {
+    sha224_t result;
+    for (size_t i=0; i<7; i++) {
+        uint32_t x = htobe32(state[i]);
+        memcpy(&result[i*4], &x, 4);
+    }
+    return result;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+// The SHA extensions keep the state as ABEF/CDGH and do two rounds per
+// sha256rnds2, four per message vector.
+__attribute__((target("sha,sse4.1")))
+static void process_shani(uint32_t* hash, const uint8_t* start, const uint8_t* end) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&hash[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&hash[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    for (; start < end; start += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+        for (size_t i=0; i<16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(start + i*16)), bswap);
+            } else {
+                __m128i x = _mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+                w[i&3] = _mm_sha256msg2_epu32(x, w[(i+3)&3]);
+            }
+            __m128i msg = _mm_add_epi32(w[i&3], _mm_loadu_si128((const __m128i*)&round_constants[i*4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&hash[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&hash[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+#define ROR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32-(n)))
+
+// Lane l of state[i] is word i of message l. Each block is loaded as
+// eight rows and transposed, so that w[t] holds word t of every message.
+__attribute__((target("avx2")))
+static void process_x8_avx2(__m256i* state, const uint8_t* const* blocks) {
+    const __m256i bswap = _mm256_set_epi8(
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i w[16];
+    for (size_t half=0; half<2; half++) {
+        __m256i r[8];
+        for (size_t l=0; l<8; l++) {
+            r[l] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(blocks[l] + half*32)), bswap);
+        }
+        __m256i t[8], u[8];
+        for (size_t i=0; i<4; i++) {
+            t[2*i] = _mm256_unpacklo_epi32(r[2*i], r[2*i+1]);
+            t[2*i+1] = _mm256_unpackhi_epi32(r[2*i], r[2*i+1]);
+        }
+        for (size_t i=0; i<2; i++) {
+            u[4*i] = _mm256_unpacklo_epi64(t[4*i], t[4*i+2]);
+            u[4*i+1] = _mm256_unpackhi_epi64(t[4*i], t[4*i+2]);
+            u[4*i+2] = _mm256_unpacklo_epi64(t[4*i+1], t[4*i+3]);
+            u[4*i+3] = _mm256_unpackhi_epi64(t[4*i+1], t[4*i+3]);
+        }
+        for (size_t i=0; i<4; i++) {
+            w[half*8+i] = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+            w[half*8+i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+        }
+    }
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+    for (size_t i=0; i<64; i++) {
+        if (i >= 16) {
+            __m256i w15 = w[(i-15)&15], w2 = w[(i-2)&15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w15, 7), ROR8(w15, 18)), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(w2, 17), ROR8(w2, 19)), _mm256_srli_epi32(w2, 10));
+            w[i&15] = _mm256_add_epi32(_mm256_add_epi32(w[i&15], s0), _mm256_add_epi32(w[(i-7)&15], s1));
+        }
+        __m256i ss1 = _mm256_xor_si256(_mm256_xor_si256(ROR8(e, 6), ROR8(e, 11)), ROR8(e, 25));
+        __m256i ch = _mm256_xor_si256(g, _mm256_and_si256(e, _mm256_xor_si256(f, g)));
+        __m256i temp1 = _mm256_add_epi32(_mm256_add_epi32(h, ss1),
+            _mm256_add_epi32(_mm256_add_epi32(ch, w[i&15]), _mm256_set1_epi32(round_constants[i])));
+        __m256i ss0 = _mm256_xor_si256(_mm256_xor_si256(ROR8(a, 2), ROR8(a, 13)), ROR8(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, temp1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(temp1, _mm256_add_epi32(ss0, maj));
+    }
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+    state[5] = _mm256_add_epi32(state[5], f);
+    state[6] = _mm256_add_epi32(state[6], g);
+    state[7] = _mm256_add_epi32(state[7], h);
+}
+
+// Hashes up to eight messages of the same length, one per lane; unused
+// lanes repeat the first message.
+__attribute__((target("avx2")))
+static void hash_x8_avx2(const uint8_t* const* messages, size_t len, size_t count, sha224_t* out) {
+    __m256i state[8];
+    for (size_t i=0; i<8; i++) state[i] = _mm256_set1_epi32(sha224_iv[i]);
+    const uint8_t* blocks[8];
+    for (size_t off=0; off + 64 <= len; off += 64) {
+        for (size_t l=0; l<8; l++) blocks[l] = messages[l < count ? l : 0] + off;
+        process_x8_avx2(state, blocks);
+    }
+    uint8_t tails[8][128];
+    size_t tail_blocks = 0;
+    for (size_t l=0; l<8; l++) {
+        tail_blocks = pad_tail(tails[l], messages[l < count ? l : 0] + len/64*64, len);
+    }
+    for (size_t k=0; k<tail_blocks; k++) {
+        for (size_t l=0; l<8; l++) blocks[l] = tails[l] + k*64;
+        process_x8_avx2(state, blocks);
+    }
+    uint32_t words[8][8];
+    for (size_t i=0; i<8; i++) _mm256_storeu_si256((__m256i*)words[i], state[i]);
+    for (size_t l=0; l<count; l++) {
+        uint32_t lane[8];
+        for (size_t i=0; i<8; i++) lane[i] = words[i][l];
+        out[l] = state_to_digest(lane);
+    }
+}
+#endif
+
+struct SHA224Backend {
+    const char* name;
+    void (*process)(uint32_t* hash, const uint8_t* start, const uint8_t* end);
+    void (*hash_many)(const uint8_t* const* messages, size_t len, size_t count, sha224_t* out);
+    size_t lanes;
+    // Groups with fewer messages than this are hashed one by one by process,
+    // as hash_many costs as much as for a full group.
+    size_t min_batch;
+};
+
+static sha224_t reference_hash(const uint8_t* begin, const uint8_t* end) {
+    uint32_t state[8];
+    memcpy(state, sha224_iv, sizeof(state));
+    size_t len = end - begin;
+    process_scalar(state, begin, begin + len/64*64);
+    uint8_t tail[128];
+    size_t blocks = pad_tail(tail, begin + len/64*64, len);
+    process_scalar(state, tail, tail + blocks*64);
+    return state_to_digest(state);
+}
+
+// Every accelerated backend has to reproduce the scalar code on a few
+// messages of awkward lengths, in full and partial groups, before it is used.
+static bool check_backend(const SHA224Backend& backend) {
+    static const size_t lengths[] = {0, 3, 55, 56, 64, 119, 1000};
+    uint8_t data[8][1000];
+    for (size_t l=0; l<8; l++) {
+        for (size_t i=0; i<sizeof(data[l]); i++) data[l][i] = i*31 + l*7 + (i>>8);
+    }
+    for (auto len: lengths) {
+        uint32_t state[8];
+        memcpy(state, sha224_iv, sizeof(state));
+        backend.process(state, data[0], data[0] + len/64*64);
+        uint32_t expected[8];
+        memcpy(expected, sha224_iv, sizeof(expected));
+        process_scalar(expected, data[0], data[0] + len/64*64);
+        if (memcmp(state, expected, sizeof(state))) return false;
+        const uint8_t* messages[8];
+        for (size_t l=0; l<8; l++) messages[l] = data[l];
+        if (!backend.hash_many) continue;
+        for (size_t count: {backend.lanes, backend.lanes/2 + 1}) {
+            sha224_t out[8];
+            backend.hash_many(messages, len, count, out);
+            for (size_t l=0; l<count; l++) {
+                if (out[l] != reference_hash(data[l], data[l] + len)) return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Hashes whole messages one at a time with a single-buffer backend.
+static void hash_one_by_one(void (*process)(uint32_t*, const uint8_t*, const uint8_t*),
+                            const uint8_t* const* messages, size_t len, size_t count, sha224_t* out) {
+    for (size_t i=0; i<count; i++) {
+        uint32_t state[8];
+        memcpy(state, sha224_iv, sizeof(state));
+        process(state, messages[i], messages[i] + len/64*64);
+        uint8_t tail[128];
+        size_t blocks = pad_tail(tail, messages[i] + len/64*64, len);
+        process(state, tail, tail + blocks*64);
+        out[i] = state_to_digest(state);
+    }
+}
+
+static std::vector<SHA224Backend> supported_backends() {
+    std::vector<SHA224Backend> backends;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    bool has_sha = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29));
+    if (has_sha && __builtin_cpu_supports("sse4.1")) {
+        backends.push_back({"sha-ni", process_shani, nullptr, 1, 1});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        backends.push_back({"avx2-x8", process_scalar, hash_x8_avx2, 8, 1});
+    }
+#endif
+    return backends;
+}
+
+// Best of a few runs, as the first one pays for faulting the data in.
+template<typename F>
+static double time_ns(F f) {
+    double best = 0;
+    for (size_t run=0; run<3; run++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (run == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+// The SHA extensions run one message faster than the scalar code by far,
+// but the AVX2 backend hashes eight at once, and which of them gets more
+// done depends on the CPU. So when both pass their check, a full group of
+// chunk sized messages is timed on each. The multi-buffer backend is kept
+// for groups that it hashes faster than the SHA extensions would hash the
+// messages one by one, and smaller groups are hashed one by one.
+static SHA224Backend select_backend() {
+    SHA224Backend backend = {"scalar", process_scalar, nullptr, 1, 1};
+    const SHA224Backend* multi = nullptr;
+    const std::vector<SHA224Backend>& candidates = supported_backends();
+    for (auto& candidate: candidates) {
+        if (!check_backend(candidate)) continue;
+        if (candidate.hash_many) {
+            multi = &candidate;
+        } else {
+            backend.name = candidate.name;
+            backend.process = candidate.process;
+        }
+    }
+    if (!multi) return backend;
+    if (backend.process == process_scalar) {
+        backend.hash_many = multi->hash_many;
+        backend.lanes = multi->lanes;
+        return backend;
+    }
+    std::vector<uint8_t> data(0x10000 * multi->lanes);
+    for (size_t i=0; i<data.size(); i++) data[i] = i*31 + (i>>13);
+    std::vector<const uint8_t*> messages(multi->lanes);
+    for (size_t l=0; l<messages.size(); l++) messages[l] = &data[l*0x10000];
+    std::vector<sha224_t> out(multi->lanes);
+    double many = time_ns([&] { multi->hash_many(messages.data(), 0x10000, multi->lanes, out.data()); });
+    double one = time_ns([&] { hash_one_by_one(backend.process, messages.data(), 0x10000, 1, out.data()); });
+    size_t min_batch = one > 0 ? (size_t)(many / one) + 1 : multi->lanes + 1;
+    if (min_batch <= multi->lanes) {
+        backend.hash_many = multi->hash_many;
+        backend.lanes = multi->lanes;
+        backend.min_batch = min_batch;
+    }
+    return backend;
+}
+
+static const SHA224Backend& get_backend() {
+    static SHA224Backend backend = select_backend();
+    return backend;
+}
+
+void SHA224::process(const uint8_t* start, const uint8_t* end) {
+    total_len += end-start;
+    get_backend().process(hash, start, end);
+}
+
+size_t SHA224::lanes() {
+    return get_backend().lanes;
+}
+
+void SHA224::hash_many(const uint8_t* const* messages, size_t len, size_t count, sha224_t* out) {
+    const SHA224Backend& backend = get_backend();
+    for (size_t i=0; i<count; i+=backend.lanes) {
+        size_t group = std::min(backend.lanes, count - i);
+        if (backend.hash_many && group >= backend.min_batch) {
+            backend.hash_many(messages + i, len, group, out + i);
+        } else {
+            hash_one_by_one(backend.process, messages + i, len, group, out + i);
+        }
+    }
+}
+
+bool SHA224::check_backends(std::vector<std::string>& checked) {
+    bool ok = true;
+    for (auto& backend: supported_backends()) {
+        checked.push_back(backend.name);
+        ok = check_backend(backend) && ok;
+    }
+    return ok;
+}
+
 void SHA224::update(const uint8_t* start, const uint8_t* end) {
     if (buff_used) {
         int8_t to_copy = 64 - buff_used;
@@ -155,8 +491,8 @@ sha224_t SHA224::get() {
     size_t i;
     size_t padding = 0;
     size_t sz = buff_used;
-    padding = sz<56 ? (56-sz) : (120-sz);
-    uint8_t data[64];
+    padding = sz<=56 ? (56-sz) : (120-sz);
+    uint8_t data[64 + sizeof(uint64_t)];
     for (i=0; i<padding; i++) data[i] = 0;
     msglen = htobe64(msglen*8);
     memcpy(data+padding, &msglen, sizeof(uint64_t));
@@ -210,3 +546,71 @@ hash_t Hasher::get_strong_hash() const {
 Chunk Hasher::get_chunk() const {
     return {&window[window_start], &window[window_end]};
 }
+
+typedef uint32_t hash_lanes __attribute__((vector_size(32)));
+typedef uint8_t byte_lanes __attribute__((vector_size(8)));
+
+static const size_t lane_count = 8;
+static const size_t lane_groups = 4;
+static const size_t lane_stride = lane_count * lane_groups;
+
+// By squaring, as ChunkHasher raises MULTIPLIER to the size of every frame.
+static uint32_t power(uint32_t base, size_t exp) {
+    uint32_t res = 1;
+    for (; exp; exp >>= 1) {
+        if (exp & 1) res *= base;
+        base *= base;
+    }
+    return res;
+}
+
+// The weak hash is sum(data[i] * MULTIPLIER^(n-1-i)). Byte i of every
+// lane_stride-sized block is accumulated in lane i, so the loop has no
+// dependency between lanes; the lanes are then combined with the power of
+// MULTIPLIER that matches their position.
+__attribute__((target_clones("avx2", "default")))
+uint32_t get_block_weak_hash(const uint8_t* begin, const uint8_t* end) {
+    const size_t blocks = (end - begin) / lane_stride;
+    const uint32_t step = power(MULTIPLIER, lane_stride);
+    hash_lanes acc[lane_groups] = {};
+    for (size_t k=0; k<blocks; k++) {
+        for (size_t g=0; g<lane_groups; g++) {
+            byte_lanes bytes;
+            memcpy(&bytes, begin + k*lane_stride + g*lane_count, lane_count);
+            acc[g] = acc[g] * step + __builtin_convertvector(bytes, hash_lanes);
+        }
+    }
+    uint32_t hash = 0;
+    uint32_t mult = 1;
+    for (size_t i=lane_stride; i-- > 0;) {
+        hash += acc[i / lane_count][i % lane_count] * mult;
+        mult *= MULTIPLIER;
+    }
+    for (const uint8_t* cur = begin + blocks*lane_stride; cur != end; cur++) {
+        hash = hash * MULTIPLIER + *cur;
+    }
+    return hash;
+}
+
+hash_t get_block_hash(const uint8_t* begin, const uint8_t* end) {
+    SHA224 strong_hash;
+    strong_hash.update(begin, end);
+    return {get_block_weak_hash(begin, end), strong_hash.get()};
+}
+
+void ChunkHasher::update(const uint8_t* begin, const uint8_t* end) {
+    weak_hash = weak_hash * power(MULTIPLIER, end - begin) + get_block_weak_hash(begin, end);
+    strong_hash.update(begin, end);
+}
+
+hash_t ChunkHasher::get() {
+    return {weak_hash, strong_hash.get()};
+}
+
+void get_block_hashes(const uint8_t* const* blocks, size_t len, size_t count, hash_t* out) {
+    std::vector<sha224_t> strong(count);
+    SHA224::hash_many(blocks, len, count, strong.data());
+    for (size_t i=0; i<count; i++) {
+        out[i] = {get_block_weak_hash(blocks[i], blocks[i] + len), strong[i]};
+    }
+}
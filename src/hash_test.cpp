@@ -0,0 +1,101 @@
+#include "hash.h"
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+static size_t failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (ok) return;
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+}
+
+// Every backend the CPU supports, including the multi-buffer one that is not
+// used when the SHA extensions are faster.
+static void test_backends() {
+    std::vector<std::string> checked;
+    check(SHA224::check_backends(checked), "accelerated backends match the scalar code");
+    for (auto& x: checked) printf("Checked the %s backend\n", x.c_str());
+}
+
+// hash_many gives the same digests as hashing each message in pieces,
+// whether the group is full, partial, or a single message.
+static void test_hash_many() {
+    const size_t max_count = 2 * SHA224::lanes() + 3;
+    std::vector<uint8_t> data(max_count * 4099);
+    for (size_t i=0; i<data.size(); i++) data[i] = i*131 + (i>>9);
+    for (size_t len: {0, 1, 55, 56, 63, 64, 65, 127, 128, 4099}) {
+        for (size_t count=1; count<=max_count; count++) {
+            std::vector<const uint8_t*> messages(count);
+            for (size_t i=0; i<count; i++) messages[i] = &data[i * len];
+            std::vector<sha224_t> out(count);
+            SHA224::hash_many(messages.data(), len, count, out.data());
+            for (size_t i=0; i<count; i++) {
+                SHA224 expected;
+                expected.update(messages[i], messages[i] + len/3);
+                expected.update(messages[i] + len/3, messages[i] + len);
+                check(out[i] == expected.get(), "hash_many matches SHA224::update");
+            }
+        }
+    }
+}
+
+// A chunk hashed as it arrives, in frames of any size, hashes the same as
+// the whole block.
+static void test_chunk_hasher() {
+    std::vector<uint8_t> data(100003);
+    for (size_t i=0; i<data.size(); i++) data[i] = i*131 + (i>>9);
+    const hash_t& expected = get_block_hash(data.data(), data.data() + data.size());
+    for (size_t frame: {1, 7, 64, 1000, 65536, 100003}) {
+        ChunkHasher hasher;
+        for (size_t i=0; i<data.size(); i+=frame) {
+            hasher.update(&data[i], &data[std::min(i + frame, data.size())]);
+        }
+        check(hasher.get() == expected, "ChunkHasher matches get_block_hash");
+    }
+}
+
+// get_block_hash agrees with a Hasher whose window holds the whole block and
+// with SHA224 fed byte by byte and in uneven pieces, for every length up to
+// three SHA blocks and around the smallest chunk, where the padding either
+// fits the last block (55 bytes past a multiple of 64) or spills over.
+static void test_block_hash() {
+    std::vector<size_t> lengths;
+    for (size_t len=0; len<=3*64+1; len++) lengths.push_back(len);
+    for (size_t len: {min_picked_chunk_size - 1, min_picked_chunk_size, min_picked_chunk_size + 1,
+                      min_picked_chunk_size + 55, min_picked_chunk_size + 56, min_picked_chunk_size - 64 + 55}) {
+        lengths.push_back(len);
+    }
+    std::vector<uint8_t> data(*std::max_element(lengths.begin(), lengths.end()));
+    for (size_t i=0; i<data.size(); i++) data[i] = i*131 + (i>>9);
+    for (size_t len: lengths) {
+        const uint8_t* begin = data.data();
+        const hash_t& expected = get_block_hash(begin, begin + len);
+
+        Hasher hasher(std::max(len, (size_t)1));
+        hasher.update(begin, begin + len/2);
+        hasher.update(begin + len/2, begin + len);
+        check(hasher.get_strong_hash() == expected, "get_block_hash matches Hasher");
+
+        SHA224 pieces;
+        for (size_t i=0, piece=1; i<len; i+=piece, piece=piece*2+1) {
+            pieces.update(begin + i, begin + std::min(i + piece, len));
+        }
+        check(pieces.get() == expected.strong_hash, "get_block_hash matches SHA224 fed in pieces");
+
+        if (len > 3*64+1) continue;
+        SHA224 bytes;
+        for (size_t i=0; i<len; i++) bytes.update(begin + i, begin + i + 1);
+        check(bytes.get() == expected.strong_hash, "get_block_hash matches SHA224 fed byte by byte");
+    }
+}
+
+int main() {
+    test_backends();
+    test_hash_many();
+    test_chunk_hasher();
+    test_block_hash();
+    if (failures) return 1;
+    printf("All hash tests passed\n");
+}
@@ -0,0 +1,82 @@
+#include "manifest.h"
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+using namespace boost::filesystem;
+using namespace boost::iostreams;
+
+static const char manifest_magic[8] = {'C', 'N', 'M', 'A', 'N', 'I', 'F', '2'};
+
+static_assert(sizeof(hash_t) == 32, "hash_t must be stored without padding");
+
+std::string ManifestCache::manifest_path(const std::string& name) const {
+    return dir + "/" + name + ".manifest";
+}
+
+bool ManifestCache::get_header(const std::string& file_path, const Chunking& chunking, ManifestHeader& header) {
+    struct stat st;
+    if (stat(file_path.c_str(), &st) != 0) return false;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, manifest_magic, sizeof(manifest_magic));
+    header.chunking = chunking.mode;
+    header.min_chunk_size = chunking.min_size;
+    header.avg_chunk_size = chunking.avg_size;
+    header.max_chunk_size = chunking.max_size;
+    header.file_size = st.st_size;
+    header.mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    header.inode = st.st_ino;
+    return true;
+}
+
+bool ManifestCache::load(const std::string& name, const ManifestHeader& header, std::vector<hash_t>& chunks, std::vector<uint32_t>& sizes) const {
+    const std::string& path = manifest_path(name);
+    if (!exists(path) || file_size(path) < sizeof(ManifestHeader)) return false;
+    mapped_file_source manifest(path);
+    const ManifestHeader* stored = (const ManifestHeader*) manifest.data();
+    if (memcmp(stored, &header, offsetof(ManifestHeader, chunk_count)) != 0) return false;
+    const bool has_sizes = header.chunking != fixed_chunking;
+    const size_t entry_size = sizeof(hash_t) + (has_sizes ? sizeof(uint32_t) : 0);
+    if (manifest.size() != sizeof(ManifestHeader) + stored->chunk_count * entry_size) return false;
+    const hash_t* begin = (const hash_t*) (manifest.data() + sizeof(ManifestHeader));
+    if (has_sizes) {
+        const uint32_t* sizes_begin = (const uint32_t*) (begin + stored->chunk_count);
+        sizes.assign(sizes_begin, sizes_begin + stored->chunk_count);
+    } else {
+        sizes = cut_chunks(nullptr, header.file_size, header.get_chunking());
+    }
+    uint64_t total = 0;
+    for (auto x: sizes) total += x;
+    if (sizes.size() != stored->chunk_count || total != header.file_size) return false;
+    chunks.assign(begin, begin + stored->chunk_count);
+    return true;
+}
+
+// The manifest is only written if the file did not change while it was
+// being hashed, and it is renamed into place so readers never see half of it.
+bool ManifestCache::store(const std::string& name, const std::string& file_path, const ManifestHeader& header,
+                          const std::vector<hash_t>& chunks, const std::vector<uint32_t>& sizes) const {
+    ManifestHeader current;
+    if (!get_header(file_path, header.get_chunking(), current) || memcmp(&current, &header, sizeof(header)) != 0) return false;
+    current.chunk_count = chunks.size();
+    boost::system::error_code ec;
+    create_directories(dir, ec);
+    const std::string& path = manifest_path(name);
+    const std::string& tmp_path = path + ".tmp";
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (out == nullptr) return false;
+    bool ok = fwrite(&current, sizeof(current), 1, out) == 1;
+    if (!chunks.empty()) ok = ok && fwrite(&chunks[0], sizeof(hash_t), chunks.size(), out) == chunks.size();
+    if (!chunks.empty() && header.chunking != fixed_chunking) {
+        ok = ok && fwrite(&sizes[0], sizeof(uint32_t), sizes.size(), out) == sizes.size();
+    }
+    ok = fclose(out) == 0 && ok;
+    if (ok) boost::filesystem::rename(tmp_path, path, ec);
+    if (!ok || ec) {
+        boost::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+#include "multicast.h"
+#include <string.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/asio/ip/multicast.hpp>
+
+const static size_t fragment_header_size = 1 + sizeof(hash_t) + 4 + 4;
+const static size_t multicast_receive_buffer = 0x800000;
+
+MulticastSender::MulticastSender(boost::asio::io_service& io_service, const address& group, const address& interface, size_t rate_mbit):
+    socket(io_service, udp::v4()), group(group, multicast_port), ns_per_byte(8000.0 / rate_mbit),
+    next_send(std::chrono::steady_clock::now()), timer(io_service) {
+    if (!interface.is_unspecified()) {
+        socket.set_option(boost::asio::ip::multicast::outbound_interface(interface.to_v4()));
+    }
+}
+
+void MulticastSender::pace(size_t bytes, boost::asio::yield_context yield) {
+    auto now = std::chrono::steady_clock::now();
+    if (next_send < now) next_send = now;
+    next_send += std::chrono::nanoseconds((int64_t)(bytes * ns_per_byte));
+    if (next_send - now > std::chrono::milliseconds(1)) {
+        timer.expires_at(next_send);
+        timer.async_wait(yield);
+    }
+}
+
+void MulticastSender::send_chunk(const hash_t& hash, const Chunk& chunk, boost::asio::yield_context yield) {
+    uint8_t kind = multicast_fragment;
+    uint32_t netsize = htonl(chunk.size);
+    for (size_t offset=0; offset<chunk.size; offset+=multicast_fragment_size) {
+        size_t size = std::min(multicast_fragment_size, chunk.size - offset);
+        uint32_t netoffset = htonl(offset);
+        std::vector<boost::asio::const_buffer> buffers;
+        buffers.emplace_back(&kind, 1);
+        hash.add_buffers(buffers);
+        buffers.emplace_back(&netsize, 4);
+        buffers.emplace_back(&netoffset, 4);
+        buffers.emplace_back(chunk.data + offset, size);
+        pace(fragment_header_size + size, yield);
+        socket.async_send_to(buffers, group, yield);
+    }
+}
+
+void MulticastSender::send_round_end(uint32_t round, const std::string& name, boost::asio::yield_context yield) {
+    uint8_t kind = multicast_round_end;
+    uint32_t netround = htonl(round);
+    std::vector<boost::asio::const_buffer> buffers;
+    buffers.emplace_back(&kind, 1);
+    buffers.emplace_back(&netround, 4);
+    buffers.emplace_back(name.data(), name.size());
+    pace(5 + name.size(), yield);
+    socket.async_send_to(buffers, group, yield);
+}
+
+MulticastReceiver::MulticastReceiver(boost::asio::io_service& io_service, const address& group, const address& interface):
+    socket(io_service), buffer(0x10000) {
+    socket.open(udp::v4());
+    socket.set_option(udp::socket::reuse_address(true));
+    socket.set_option(udp::socket::receive_buffer_size(multicast_receive_buffer));
+    socket.bind(udp::endpoint(group, multicast_port));
+    socket.set_option(boost::asio::ip::multicast::join_group(group.to_v4(), interface.to_v4()));
+}
+
+// Datagrams that do not parse are skipped.
+multicast_kind MulticastReceiver::receive(boost::asio::yield_context yield, MulticastFragment& fragment, MulticastRoundEnd& round_end) {
+    for (;;) {
+        size_t size = socket.async_receive(boost::asio::buffer(buffer), yield);
+        const uint8_t* data = buffer.data();
+        uint32_t netvalue;
+        if (size > fragment_header_size && data[0] == multicast_fragment) {
+            memcpy(&fragment.hash, data+1, sizeof(hash_t));
+            memcpy(&netvalue, data+1+sizeof(hash_t), 4);
+            fragment.size = ntohl(netvalue);
+            memcpy(&netvalue, data+5+sizeof(hash_t), 4);
+            fragment.offset = ntohl(netvalue);
+            fragment.data = Chunk(data + fragment_header_size, data + size);
+            return multicast_fragment;
+        }
+        if (size >= 5 && data[0] == multicast_round_end) {
+            memcpy(&netvalue, data+1, 4);
+            round_end.round = ntohl(netvalue);
+            round_end.name.assign((const char*)data+5, size-5);
+            return multicast_round_end;
+        }
+    }
+}
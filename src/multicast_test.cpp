@@ -0,0 +1,133 @@
+#include "multicast.h"
+#include "communication.h"
+#include "hash.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+static size_t failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (ok) return;
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+}
+
+static const char* file_name = "img";
+static const size_t max_rounds = 5;
+
+// A chunk being put together from fragments, as a client does.
+struct Assembly {
+    std::vector<uint8_t> data;
+    std::vector<bool> received;
+    size_t remaining;
+};
+
+// Chunks are multicast over the loopback interface by a paced sender, while
+// the receiver drops every third fragment of the first round. The NACK of
+// each round names the chunks that lost a fragment, which are sent again
+// until every one reassembles byte for byte.
+static void test_resend() {
+    std::vector<std::vector<uint8_t>> chunks;
+    for (size_t size: {1, 1400, 1401, 5000, 20000, 65536}) {
+        chunks.emplace_back(size);
+        for (size_t i=0; i<size; i++) chunks.back()[i] = (i + chunks.size())*131 + (i>>9);
+    }
+    std::vector<hash_t> hashes;
+    std::vector<Assembly> assembled;
+    for (auto& x: chunks) {
+        hashes.push_back(get_block_hash(x.data(), x.data() + x.size()));
+        size_t fragments = (x.size() + multicast_fragment_size - 1) / multicast_fragment_size;
+        assembled.push_back({std::vector<uint8_t>(x.size()), std::vector<bool>(fragments), fragments});
+    }
+
+    boost::asio::io_service io_service;
+    address group = address::from_string("239.255.77.2");
+    address loopback = address::from_string("127.0.0.1");
+    std::vector<NackPacket> nacks;
+    std::vector<size_t> resent;
+    size_t rounds = 0;
+    bool done = false;
+
+    boost::asio::spawn(io_service, [&] (boost::asio::yield_context yield) {
+        try {
+            MulticastReceiver receiver(io_service, group, loopback);
+            MulticastFragment fragment;
+            MulticastRoundEnd round_end;
+            size_t seen = 0;
+            while (!done) {
+                if (receiver.receive(yield, fragment, round_end) == multicast_round_end) {
+                    if (nacks.size() == round_end.round) continue;
+                    NackPacket packet(round_end.name, round_end.round, chunks.size());
+                    for (size_t i=0; i<chunks.size(); i++) {
+                        if (assembled[i].remaining) packet.set_missing(i);
+                    }
+                    nacks.push_back(packet);
+                    continue;
+                }
+                if (nacks.empty() && seen++ % 3 == 1) continue;
+                auto it = std::find(hashes.begin(), hashes.end(), fragment.hash);
+                if (it == hashes.end()) continue;
+                Assembly& chunk = assembled[it - hashes.begin()];
+                size_t index = fragment.offset / multicast_fragment_size;
+                if (fragment.size != chunk.data.size() || index >= chunk.received.size() || chunk.received[index]) continue;
+                memcpy(chunk.data.data() + fragment.offset, fragment.data.data, fragment.data.size);
+                chunk.received[index] = true;
+                chunk.remaining--;
+            }
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Receiver: %s\n", e.what());
+            done = true;
+        }
+    });
+
+    boost::asio::spawn(io_service, [&] (boost::asio::yield_context yield) {
+        boost::asio::steady_timer timer(io_service);
+        try {
+            MulticastSender sender(io_service, group, loopback, 100);
+            timer.expires_after(std::chrono::milliseconds(100));
+            timer.async_wait(yield);
+            for (uint32_t round=1; round<=max_rounds && !done; round++) {
+                std::vector<size_t> selected;
+                for (size_t i=0; i<chunks.size(); i++) {
+                    if (round == 1 || nacks.back().is_missing(i)) selected.push_back(i);
+                }
+                if (selected.empty()) break;
+                if (round == 2) resent = selected;
+                rounds = round;
+                for (auto i: selected) {
+                    sender.send_chunk(hashes[i], Chunk(chunks[i].size(), chunks[i].data()), yield);
+                }
+                for (size_t i=0; i<100 && nacks.size() < round; i++) {
+                    sender.send_round_end(round, file_name, yield);
+                    timer.expires_after(std::chrono::milliseconds(10));
+                    timer.async_wait(yield);
+                }
+            }
+        } catch (const std::exception& e) {
+            fprintf(stderr, "Sender: %s\n", e.what());
+        }
+        done = true;
+        io_service.stop();
+    });
+
+    io_service.run();
+    check(nacks.size() >= 2, "every round end is answered");
+    if (nacks.empty()) return;
+    std::vector<size_t> lost;
+    for (size_t i=0; i<chunks.size(); i++) {
+        if (nacks[0].is_missing(i)) lost.push_back(i);
+    }
+    check(!lost.empty() && lost.size() < chunks.size(), "the dropped fragments leave some chunks incomplete");
+    check(resent == lost, "exactly the chunks in the NACK are sent again");
+    check(rounds == 2, "the second round completes every chunk");
+    for (size_t i=0; i<chunks.size(); i++) {
+        check(assembled[i].data == chunks[i], "the chunk reassembles byte for byte");
+    }
+}
+
+int main() {
+    test_resend();
+    if (failures) return 1;
+    printf("All multicast tests passed\n");
+}
@@ -0,0 +1,85 @@
+#include "communication.h"
+#include <boost/asio/io_service.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+static hash_t make_chunk(size_t i) {
+    sha224_t strong;
+    strong.fill(0);
+    for (size_t j=0; j<8; j++) strong[j] = i >> (8*j);
+    return {(uint32_t)i, strong};
+}
+
+// A writer thread sends count packets made by make over loopback, while
+// the calling thread times reading and decoding them.
+template<typename PacketType>
+static void run(const char* name, size_t count, std::function<PacketType(size_t)> make) {
+    boost::asio::io_service io_service;
+    tcp::acceptor acceptor(io_service, tcp::endpoint(address::from_string("127.0.0.1"), 0));
+    unsigned short port = acceptor.local_endpoint().port();
+    std::thread writer([port, count, &make] () {
+        boost::asio::io_service writer_service;
+        boost::asio::spawn(writer_service, [port, count, &make, &writer_service] (boost::asio::yield_context yield) {
+            tcp::socket socket(writer_service);
+            socket.async_connect(tcp::endpoint(address::from_string("127.0.0.1"), port), yield);
+            for (size_t i=0; i<count; i++) {
+                send_packet(socket, yield, make(i));
+            }
+        });
+        writer_service.run();
+    });
+
+    size_t decoded = 0;
+    size_t bytes = 0;
+    double ms = 0;
+    boost::asio::spawn(io_service, [&] (boost::asio::yield_context yield) {
+        tcp::socket socket(io_service);
+        acceptor.async_accept(socket, yield);
+        PacketReader reader(socket);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i=0; i<count; i++) {
+            if (reader.next(yield) != PacketType::type) throw std::runtime_error("Unexpected packet type");
+            PacketType packet(reader);
+            decoded++;
+        }
+        ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    });
+    io_service.run();
+    writer.join();
+
+    std::vector<boost::asio::const_buffer> buffers;
+    PacketType sample = make(0);
+    sample.add_buffers(buffers);
+    bytes = (boost::asio::buffer_size(buffers) + 5) * decoded;
+    printf("%-12s %10zu %10.1f %10.1f %14.0f %10.1f\n",
+        name, decoded, bytes / 1048576.0, ms, decoded / ms * 1000, bytes / 1048576.0 / ms * 1000);
+}
+
+int main(int argc, char** argv) {
+    size_t scale = 1;
+    if (argc == 2) {
+        scale = atol(argv[1]);
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [scale]\n", argv[0]);
+        return 1;
+    }
+    std::vector<hash_t> manifest;
+    for (size_t i=0; i<20000; i++) manifest.push_back(make_chunk(i));
+
+    printf("%-12s %10s %10s %10s %14s %10s\n", "packet", "count", "MiB", "ms", "packets/s", "MiB/s");
+    run<NewChunkPacket>("new_chunk", 200000 * scale, [] (size_t i) {
+        return NewChunkPacket(make_chunk(i));
+    });
+    run<SendChunkPacket>("send_chunk", 200000 * scale, [] (size_t i) {
+        return SendChunkPacket(i % 400, make_chunk(i));
+    });
+    run<SlotsPacket>("slots", 200000 * scale, [] (size_t i) {
+        return SlotsPacket(i, i);
+    });
+    run<FileInfoPacket>("file_info", 100 * scale, [&manifest] (size_t i) {
+        return FileInfoPacket("image", manifest.size() * chunk_max_size, Chunking(), manifest.begin(), manifest.end(), std::vector<uint32_t>());
+    });
+}
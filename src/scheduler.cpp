@@ -0,0 +1,425 @@
+#include "scheduler.h"
+#include <queue>
+#include <algorithm>
+
+static void erase_peer(std::vector<size_t>& peers, size_t peer) {
+    *std::find(peers.begin(), peers.end(), peer) = peers.back();
+    peers.pop_back();
+}
+
+bool ChunkBits::set(size_t id) {
+    if (id/64 >= words.size()) words.resize(id/64+1);
+    uint64_t mask = (uint64_t)1 << id%64;
+    if (words[id/64] & mask) return false;
+    words[id/64] |= mask;
+    bits++;
+    return true;
+}
+
+bool ChunkBits::reset(size_t id) {
+    if (!test(id)) return false;
+    words[id/64] &= ~((uint64_t)1 << id%64);
+    bits--;
+    return true;
+}
+
+size_t Scheduler::intern(const hash_t& chunk) {
+    auto res = chunk_ids.emplace(chunk, chunk_hashes.size());
+    if (res.second) {
+        chunk_hashes.push_back(chunk);
+        owners.emplace_back();
+        wanting.emplace_back();
+    }
+    return res.first->second;
+}
+
+size_t Scheduler::add_peer() {
+    size_t id;
+    if (!free_ids.empty()) {
+        id = free_ids.back();
+        free_ids.pop_back();
+    } else {
+        id = peers.size();
+        peers.emplace_back();
+        active.push_back(false);
+        for (auto& row: useful) row.push_back(0);
+        useful.emplace_back(id+1, 0);
+        for (auto& row: busy) row.push_back(0);
+        busy.emplace_back(id+1, 0);
+        for (auto& row: carrying) row.push_back(0);
+        carrying.emplace_back(id+1, 0);
+        out_degree.push_back(0);
+        upload_slots.push_back(0);
+        download_slots.push_back(0);
+        relay_uploads.push_back(0);
+        relay_downloads.push_back(0);
+        held.push_back(0);
+        seeds.push_back(false);
+        planned.emplace_back();
+        planned_by.emplace_back();
+        visited.push_back(0);
+        parent.push_back(0);
+        sender_visited.push_back(0);
+        via.push_back(0);
+        failed_at.push_back(0);
+    }
+    active[id] = true;
+    upload_slots[id] = upload_slots_default;
+    download_slots[id] = download_slots_default;
+    return id;
+}
+
+void Scheduler::remove_peer(size_t peer) {
+    while (!peers[peer].incoming.empty()) {
+        finish_transfer(peer, peers[peer].incoming.begin()->first);
+    }
+    for (size_t r=0; r<peers.size(); r++) {
+        std::vector<size_t> lost;
+        for (auto& x: peers[r].incoming) {
+            if (x.second == peer) lost.push_back(x.first);
+        }
+        for (auto chunk: lost) {
+            finish_transfer(r, chunk);
+            drop_relays(r, chunk);
+        }
+    }
+    while (!planned[peer].empty()) unplan(peer, planned[peer].back());
+    while (!planned_by[peer].empty()) unplan(planned_by[peer].back(), peer);
+    peers[peer].owned.for_each([this, peer] (size_t chunk) {
+        size_t replicas = owners[chunk].size();
+        erase_peer(owners[chunk], peer);
+        update_replicas(chunk, replicas);
+    });
+    std::fill(busy[peer].begin(), busy[peer].end(), 0);
+    peers[peer].missing.for_each([this, peer] (size_t chunk) {
+        erase_peer(wanting[chunk], peer);
+        if (wanting[chunk].empty()) by_replicas[owners[chunk].size()].reset(chunk);
+    });
+    for (size_t s=0; s<peers.size(); s++) {
+        if (useful[s][peer]) out_degree[s]--;
+        useful[s][peer] = 0;
+    }
+    std::fill(useful[peer].begin(), useful[peer].end(), 0);
+    out_degree[peer] = 0;
+    held[peer] = 0;
+    seeds[peer] = false;
+    peers[peer] = PeerChunks();
+    active[peer] = false;
+    free_ids.push_back(peer);
+    generation++;
+}
+
+// Pairs beyond the new slots are dropped now if they have nothing in
+// flight, and otherwise once their chunk arrives.
+void Scheduler::set_slots(size_t peer, size_t upload, size_t download) {
+    upload_slots[peer] = upload;
+    download_slots[peer] = download;
+    for (size_t i=planned[peer].size(); i-- && planned[peer].size() + relay_uploads[peer] > upload;) {
+        if (idle(peer, planned[peer][i])) unplan(peer, planned[peer][i]);
+    }
+    for (size_t i=planned_by[peer].size(); i-- && planned_by[peer].size() + relay_downloads[peer] > download;) {
+        if (idle(planned_by[peer][i], peer)) unplan(planned_by[peer][i], peer);
+    }
+    generation++;
+}
+
+// A seed is matched after every other sender, so that its uplink is only
+// used for what the other peers cannot provide.
+void Scheduler::set_seed(size_t peer) {
+    seeds[peer] = true;
+    generation++;
+}
+
+// A held peer is not given anything to download, e.g. while it is still
+// checking which chunks it already has.
+void Scheduler::hold(size_t peer) {
+    held[peer]++;
+    for (size_t i=planned_by[peer].size(); i--;) {
+        size_t s = planned_by[peer][i];
+        if (!idle(s, peer)) continue;
+        unplan(s, peer);
+        generation++;
+    }
+}
+
+void Scheduler::release(size_t peer) {
+    if (held[peer] && --held[peer] == 0) generation++;
+}
+
+void Scheduler::add_needed(size_t peer, const hash_t& hash) {
+    size_t chunk = intern(hash);
+    PeerChunks& p = peers[peer];
+    if (!p.needed.set(chunk)) return;
+    if (p.owned.test(chunk)) return;
+    p.missing.set(chunk);
+    std::vector<size_t>& chunk_wanting = wanting[chunk];
+    chunk_wanting.push_back(peer);
+    if (chunk_wanting.size() == 1) {
+        size_t replicas = owners[chunk].size();
+        if (by_replicas.size() <= replicas) by_replicas.resize(replicas+1);
+        by_replicas[replicas].set(chunk);
+    }
+    for (auto s: owners[chunk]) {
+        add_useful(s, peer);
+    }
+}
+
+void Scheduler::add_owned(size_t peer, const hash_t& hash) {
+    size_t chunk = intern(hash);
+    PeerChunks& p = peers[peer];
+    if (p.receiving.test(chunk)) finish_transfer(peer, chunk);
+    if (!p.owned.set(chunk)) return;
+    std::vector<size_t>& chunk_owners = owners[chunk];
+    if (p.missing.reset(chunk)) {
+        erase_peer(wanting[chunk], peer);
+        if (wanting[chunk].empty()) by_replicas[chunk_owners.size()].reset(chunk);
+        for (auto s: chunk_owners) {
+            remove_useful(s, peer);
+        }
+    }
+    for (auto r: wanting[chunk]) {
+        add_useful(peer, r);
+        if (peers[r].receiving.test(chunk)) busy[peer][r]++;
+    }
+    chunk_owners.push_back(peer);
+    update_replicas(chunk, chunk_owners.size()-1);
+}
+
+// Only chunks that some peer still lacks are kept in the replica buckets.
+void Scheduler::update_replicas(size_t chunk, size_t old_replicas) {
+    if (wanting[chunk].empty()) return;
+    size_t replicas = owners[chunk].size();
+    by_replicas[old_replicas].reset(chunk);
+    if (by_replicas.size() <= replicas) by_replicas.resize(replicas+1);
+    by_replicas[replicas].set(chunk);
+}
+
+void Scheduler::add_useful(size_t sender, size_t receiver) {
+    if (useful[sender][receiver]++ == 0) out_degree[sender]++;
+    generation++;
+}
+
+void Scheduler::remove_useful(size_t sender, size_t receiver) {
+    if (--useful[sender][receiver] == 0) out_degree[sender]--;
+}
+
+bool Scheduler::can_upload(size_t sender) const {
+    return planned[sender].size() + relay_uploads[sender] < upload_slots[sender];
+}
+
+bool Scheduler::can_download(size_t receiver) const {
+    return !held[receiver] && planned_by[receiver].size() + relay_downloads[receiver] < download_slots[receiver];
+}
+
+size_t Scheduler::plans(size_t sender, size_t receiver) const {
+    return std::count(planned[sender].begin(), planned[sender].end(), receiver);
+}
+
+// Chunks the receiver already gets from anyone cannot be sent to it, and
+// the pairs with one in flight are counted among them.
+size_t Scheduler::pair_load(size_t sender, size_t receiver) const {
+    return plans(sender, receiver) + busy[sender][receiver] - carrying[sender][receiver];
+}
+
+void Scheduler::plan(size_t sender, size_t receiver) {
+    planned[sender].push_back(receiver);
+    planned_by[receiver].push_back(sender);
+}
+
+void Scheduler::unplan(size_t sender, size_t receiver) {
+    std::vector<size_t>& fw = planned[sender];
+    std::vector<size_t>& bw = planned_by[receiver];
+    fw.erase(std::find(fw.begin(), fw.end(), receiver));
+    bw.erase(std::find(bw.begin(), bw.end(), sender));
+}
+
+bool Scheduler::over_slots(size_t sender, size_t receiver) const {
+    return held[receiver] || planned[sender].size() + relay_uploads[sender] > upload_slots[sender] ||
+        planned_by[receiver].size() + relay_downloads[receiver] > download_slots[receiver];
+}
+
+// A pair with a chunk in flight cannot be moved, so only idle ones take part
+// in the alternating paths.
+bool Scheduler::augment(size_t sender) {
+    visit_stamp++;
+    std::queue<size_t> q;
+    q.push(sender);
+    sender_visited[sender] = visit_stamp;
+    size_t augmenting = peers.size();
+    while (!q.empty() && augmenting == peers.size()) {
+        size_t cur = q.front();
+        q.pop();
+        for (size_t x=0; x<peers.size(); x++) {
+            if (visited[x] == visit_stamp || useful[cur][x] <= pair_load(cur, x)) continue;
+            visited[x] = visit_stamp;
+            parent[x] = cur;
+            if (can_download(x)) {
+                augmenting = x;
+                break;
+            }
+            for (auto s: planned_by[x]) {
+                if (sender_visited[s] == visit_stamp || !idle(s, x)) continue;
+                sender_visited[s] = visit_stamp;
+                via[s] = x;
+                q.push(s);
+            }
+        }
+    }
+    if (augmenting == peers.size()) return false;
+    for (;;) {
+        size_t cur = parent[augmenting];
+        plan(cur, augmenting);
+        if (cur == sender) break;
+        augmenting = via[cur];
+        unplan(cur, augmenting);
+    }
+    return true;
+}
+
+bool Scheduler::pick_chunk(size_t sender, size_t receiver, size_t& chunk) const {
+    const PeerChunks& s = peers[sender];
+    const PeerChunks& r = peers[receiver];
+    size_t words = std::min(s.owned.word_count(), r.missing.word_count());
+    for (size_t replicas=1; replicas<by_replicas.size(); replicas++) {
+        const ChunkBits& bucket = by_replicas[replicas];
+        if (!bucket.size()) continue;
+        size_t n = std::min(words, bucket.word_count());
+        for (size_t i=0; i<n; i++) {
+            uint64_t w = bucket.word(i) & r.missing.word(i) & ~r.receiving.word(i) & s.owned.word(i);
+            if (!w) continue;
+            chunk = i*64 + __builtin_ctzll(w);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::start_transfer(size_t sender, size_t receiver, size_t chunk, bool relay) {
+    if (relay) {
+        relay_uploads[sender]++;
+        relay_downloads[receiver]++;
+        peers[receiver].relayed.set(chunk);
+    } else {
+        carrying[sender][receiver]++;
+    }
+    for (auto o: owners[chunk]) busy[o][receiver]++;
+    peers[receiver].incoming.emplace(chunk, sender);
+    peers[receiver].receiving.set(chunk);
+}
+
+// The pair stays planned for the next chunk, unless its slots have been
+// taken away meanwhile.
+void Scheduler::finish_transfer(size_t receiver, size_t chunk) {
+    auto it = peers[receiver].incoming.find(chunk);
+    size_t sender = it->second;
+    peers[receiver].incoming.erase(it);
+    peers[receiver].receiving.reset(chunk);
+    if (peers[receiver].relayed.reset(chunk)) {
+        relay_uploads[sender]--;
+        relay_downloads[receiver]--;
+    } else {
+        carrying[sender][receiver]--;
+        if (over_slots(sender, receiver)) unplan(sender, receiver);
+    }
+    for (auto o: owners[chunk]) busy[o][receiver]--;
+    generation++;
+}
+
+void Scheduler::extend_chain(Transfer& transfer, size_t chunk) {
+    size_t last = transfer.receiver;
+    while (transfer.relays.size() < max_relays && can_upload(last)) {
+        size_t next = peers.size();
+        for (auto r: wanting[chunk]) {
+            if (r == last || peers[r].receiving.test(chunk) || !can_download(r)) continue;
+            next = r;
+            break;
+        }
+        if (next == peers.size()) break;
+        start_transfer(last, next, chunk, true);
+        transfer.relays.push_back(next);
+        last = next;
+    }
+}
+
+void Scheduler::cancel_hop(size_t sender, size_t receiver, size_t chunk) {
+    auto it = peers[receiver].incoming.find(chunk);
+    if (it == peers[receiver].incoming.end() || it->second != sender) return;
+    finish_transfer(receiver, chunk);
+}
+
+// Nothing reaches the rest of a chain once a hop fails, so all of it goes.
+void Scheduler::cancel_transfer(const Transfer& transfer) {
+    auto id = chunk_ids.find(transfer.chunk);
+    if (id == chunk_ids.end()) return;
+    cancel_hop(transfer.sender, transfer.receiver, id->second);
+    size_t last = transfer.receiver;
+    for (auto r: transfer.relays) {
+        cancel_hop(last, r, id->second);
+        last = r;
+    }
+}
+
+// Only the sender or the receiver of a transfer may give up on it.
+void Scheduler::fail_transfer(size_t reporter, size_t receiver, const hash_t& hash) {
+    auto id = chunk_ids.find(hash);
+    if (id == chunk_ids.end() || receiver >= peers.size() || !active[receiver]) return;
+    size_t chunk = id->second;
+    auto it = peers[receiver].incoming.find(chunk);
+    if (it == peers[receiver].incoming.end() || (reporter != receiver && reporter != it->second)) return;
+    finish_transfer(receiver, chunk);
+    drop_relays(receiver, chunk);
+}
+
+// The hops of a chain after a peer that will not get the chunk lose their
+// source along with it.
+void Scheduler::drop_relays(size_t from, size_t chunk) {
+    std::vector<size_t> lost(1, from);
+    while (!lost.empty()) {
+        size_t sender = lost.back();
+        lost.pop_back();
+        for (auto r: wanting[chunk]) {
+            auto hop = peers[r].incoming.find(chunk);
+            if (hop == peers[r].incoming.end() || hop->second != sender) continue;
+            finish_transfer(r, chunk);
+            lost.push_back(r);
+        }
+    }
+}
+
+std::vector<Transfer> Scheduler::get_transfers() {
+    // A sender with free slots that had no augmenting path keeps having none
+    // until an edge gains a chunk, some slot is freed or a pair goes idle,
+    // so it is not searched again.
+    for (size_t pass=0; pass<2; pass++) {
+        for (size_t s=0; s<peers.size(); s++) {
+            if (!active[s] || seeds[s] != (pass == 1)) continue;
+            if (!out_degree[s] || failed_at[s] == generation) continue;
+            while (can_upload(s)) {
+                if (augment(s)) continue;
+                failed_at[s] = generation;
+                break;
+            }
+        }
+    }
+    // A pair whose chunks the receiver all gets from elsewhere is dropped,
+    // freeing its slots for the next call.
+    std::vector<Transfer> res;
+    std::vector<std::pair<size_t, size_t>> stalled;
+    for (size_t s=0; s<peers.size(); s++) {
+        for (size_t i=0; i<planned[s].size(); i++) {
+            size_t r = planned[s][i];
+            if ((size_t)std::count(planned[s].begin(), planned[s].begin()+i, r) < carrying[s][r]) continue;
+            size_t chunk;
+            if (!pick_chunk(s, r, chunk)) {
+                stalled.emplace_back(s, r);
+                continue;
+            }
+            start_transfer(s, r, chunk, false);
+            res.emplace_back(s, r, chunk_hashes[chunk]);
+            extend_chain(res.back(), chunk);
+        }
+    }
+    for (auto& x: stalled) unplan(x.first, x.second);
+    if (!stalled.empty()) generation++;
+    return res;
+}
@@ -0,0 +1,92 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+
+static hash_t make_chunk(size_t i) {
+    sha224_t strong;
+    strong.fill(0);
+    for (size_t j=0; j<8; j++) strong[j] = i >> (8*j);
+    return {(uint32_t)i, strong};
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Simulates a cluster where one peer starts with the whole image, the others
+// with a random quarter of it or with nothing, and every transfer completes
+// before the next scheduling round. The hops of a relay chain complete in
+// the same round, as they are pipelined.
+static void run(size_t client_no, size_t chunk_no, size_t slots, size_t relays, bool empty, size_t max_rounds) {
+    std::mt19937 rng(client_no * chunk_no);
+    std::vector<hash_t> chunks;
+    for (size_t i=0; i<chunk_no; i++) chunks.push_back(make_chunk(i));
+
+    Scheduler scheduler(slots, slots);
+    scheduler.set_max_relays(relays);
+    std::vector<size_t> ids;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t c=0; c<client_no; c++) {
+        ids.push_back(scheduler.add_peer());
+        for (auto& x: chunks) scheduler.add_needed(ids.back(), x);
+    }
+    for (auto& x: chunks) scheduler.add_owned(ids[0], x);
+    for (size_t c=1; c<client_no; c++) {
+        for (size_t i=0; i<chunk_no; i++) {
+            if (!empty && rng() % 4 == 0) scheduler.add_owned(ids[c], chunks[i]);
+        }
+    }
+    double setup = elapsed_ms(start);
+
+    size_t rounds = 0;
+    size_t transfers = 0;
+    double schedule = 0;
+    double worst = 0;
+    while (rounds < max_rounds) {
+        start = std::chrono::steady_clock::now();
+        const std::vector<Transfer>& res = scheduler.get_transfers();
+        double t = elapsed_ms(start);
+        schedule += t;
+        if (t > worst) worst = t;
+        if (res.empty()) break;
+        for (auto& x: res) {
+            scheduler.add_owned(x.receiver, x.chunk);
+            for (auto r: x.relays) scheduler.add_owned(r, x.chunk);
+            transfers += 1 + x.relays.size();
+        }
+        rounds++;
+    }
+    printf("%8zu %8zu %6zu %6zu %7s %12.2f %8zu %10zu %12.4f %12.4f\n",
+        client_no, chunk_no, slots, relays, empty ? "empty" : "quarter", setup, rounds, transfers, schedule / (rounds ? rounds : 1), worst);
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> client_counts = {10, 50, 100, 300};
+    std::vector<size_t> chunk_counts = {1000, 5000, 20000};
+    std::vector<size_t> slot_counts = {1, 4};
+    std::vector<size_t> relay_counts = {0, 8};
+    size_t max_rounds = 100;
+    if (argc >= 3) {
+        client_counts = {(size_t)atol(argv[1])};
+        chunk_counts = {(size_t)atol(argv[2])};
+    }
+    if (argc == 4) {
+        max_rounds = atol(argv[3]);
+    } else if (argc != 1 && argc != 3) {
+        fprintf(stderr, "Usage: %s [clients chunks [rounds]]\n", argv[0]);
+        return 1;
+    }
+    printf("%8s %8s %6s %6s %7s %12s %8s %10s %12s %12s\n", "clients", "chunks", "slots", "relays", "start", "setup ms", "rounds", "transfers", "avg round ms", "max round ms");
+    for (auto c: client_counts) {
+        for (auto n: chunk_counts) {
+            for (auto s: slot_counts) {
+                for (auto r: relay_counts) {
+                    run(c, n, s, r, false, max_rounds);
+                    run(c, n, s, r, true, max_rounds);
+                }
+            }
+        }
+    }
+}
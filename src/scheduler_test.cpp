@@ -0,0 +1,155 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <algorithm>
+
+static size_t failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (ok) return;
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+}
+
+static hash_t make_chunk(size_t i) {
+    sha224_t strong;
+    strong.fill(0);
+    for (size_t j=0; j<8; j++) strong[j] = i >> (8*j);
+    return {(uint32_t)i, strong};
+}
+
+// A seed with a single upload slot and clients with a single download slot,
+// all of them needing the same chunk.
+static size_t setup(Scheduler& scheduler, size_t client_no, std::vector<size_t>& clients) {
+    size_t seed = scheduler.add_peer();
+    scheduler.set_slots(seed, 1, 0);
+    scheduler.set_seed(seed);
+    scheduler.add_owned(seed, make_chunk(0));
+    for (size_t i=0; i<client_no; i++) {
+        clients.push_back(scheduler.add_peer());
+        scheduler.add_needed(clients.back(), make_chunk(0));
+    }
+    return seed;
+}
+
+// The slots of a failed transfer are freed and the chunk is offered to the
+// receiver again, whichever end reports the failure; anyone else is ignored.
+static void test_failed_send() {
+    Scheduler scheduler(1, 1);
+    std::vector<size_t> clients;
+    size_t seed = setup(scheduler, 2, clients);
+    std::vector<Transfer> transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].sender == seed, "seed sends first");
+    if (transfers.size() != 1) return;
+    size_t receiver = transfers[0].receiver;
+    size_t other = receiver == clients[0] ? clients[1] : clients[0];
+    check(scheduler.get_transfers().empty(), "slots are busy while the chunk is in flight");
+
+    scheduler.fail_transfer(other, receiver, make_chunk(0));
+    check(scheduler.get_transfers().empty(), "a peer outside the transfer cannot fail it");
+
+    scheduler.fail_transfer(seed, receiver, make_chunk(0));
+    transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].sender == seed, "the seed slot is free again after its send failed");
+    if (transfers.size() != 1) return;
+    receiver = transfers[0].receiver;
+
+    scheduler.fail_transfer(receiver, receiver, make_chunk(0));
+    transfers = scheduler.get_transfers();
+    check(transfers.size() == 1, "the chunk is scheduled again after the receiver dropped it");
+    if (transfers.size() != 1) return;
+    scheduler.add_owned(transfers[0].receiver, make_chunk(0));
+    transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].chunk == make_chunk(0), "the other client gets the chunk");
+}
+
+// A failed hop drops the hops after it, and the clients they were to reach
+// get the chunk scheduled again.
+static void test_failed_relay() {
+    Scheduler scheduler(1, 1);
+    scheduler.set_max_relays(2);
+    std::vector<size_t> clients;
+    setup(scheduler, 3, clients);
+    std::vector<Transfer> transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].relays.size() == 2, "one chain reaches every client");
+    if (transfers.size() != 1 || transfers[0].relays.size() != 2) return;
+    Transfer chain = transfers[0];
+
+    scheduler.fail_transfer(chain.receiver, chain.relays[0], make_chunk(0));
+    check(scheduler.get_transfers().empty(), "the hops before the failed one go on");
+    scheduler.add_owned(chain.receiver, make_chunk(0));
+    std::vector<size_t> reached;
+    for (auto& x: scheduler.get_transfers()) {
+        reached.push_back(x.receiver);
+        reached.insert(reached.end(), x.relays.begin(), x.relays.end());
+    }
+    std::sort(reached.begin(), reached.end());
+    std::vector<size_t> expected(chain.relays);
+    std::sort(expected.begin(), expected.end());
+    check(reached == expected, "the clients the chain lost are reached again");
+}
+
+// A relay that disconnects takes the rest of its chain down with it, and
+// the clients after it get the chunk scheduled again.
+static void test_removed_relay() {
+    Scheduler scheduler(1, 1);
+    scheduler.set_max_relays(3);
+    std::vector<size_t> clients;
+    setup(scheduler, 4, clients);
+    std::vector<Transfer> transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].relays.size() == 3, "one chain reaches every client");
+    if (transfers.size() != 1 || transfers[0].relays.size() != 3) return;
+    Transfer chain = transfers[0];
+
+    scheduler.remove_peer(chain.relays[0]);
+    check(scheduler.get_transfers().empty(), "the hops before the removed relay go on");
+    scheduler.add_owned(chain.receiver, make_chunk(0));
+    std::vector<size_t> reached;
+    for (auto& x: scheduler.get_transfers()) {
+        reached.push_back(x.receiver);
+        reached.insert(reached.end(), x.relays.begin(), x.relays.end());
+    }
+    std::sort(reached.begin(), reached.end());
+    std::vector<size_t> expected(chain.relays.begin()+1, chain.relays.end());
+    std::sort(expected.begin(), expected.end());
+    check(reached == expected, "the clients after the removed relay are reached again");
+}
+
+// Two senders can both be matched to a receiver that only one of them can
+// serve. The other one is given to the next receiver instead of waiting
+// until the chunk arrives, and a pair keeps its slots between calls.
+static void test_stalled_pair() {
+    Scheduler scheduler(1, 1);
+    size_t first = scheduler.add_peer();
+    size_t second = scheduler.add_peer();
+    size_t both = scheduler.add_peer();
+    size_t other = scheduler.add_peer();
+    scheduler.set_slots(both, 0, 2);
+    scheduler.add_owned(first, make_chunk(0));
+    scheduler.add_owned(second, make_chunk(0));
+    scheduler.add_needed(both, make_chunk(0));
+    scheduler.add_needed(both, make_chunk(1));
+    scheduler.add_needed(other, make_chunk(0));
+    std::vector<Transfer> transfers = scheduler.get_transfers();
+    std::vector<Transfer> more = scheduler.get_transfers();
+    transfers.insert(transfers.end(), more.begin(), more.end());
+    check(transfers.size() == 2, "both senders get to send");
+    if (transfers.size() != 2) return;
+    check(transfers[0].receiver != transfers[1].receiver, "each receiver gets the chunk once");
+
+    size_t sender = transfers[0].receiver == both ? transfers[0].sender : transfers[1].sender;
+    scheduler.add_owned(sender, make_chunk(1));
+    check(scheduler.get_transfers().empty(), "a pair waits for its chunk to arrive");
+    scheduler.add_owned(both, make_chunk(0));
+    transfers = scheduler.get_transfers();
+    check(transfers.size() == 1 && transfers[0].sender == sender && transfers[0].chunk == make_chunk(1),
+          "the pair is given the next chunk");
+}
+
+int main() {
+    test_failed_send();
+    test_failed_relay();
+    test_removed_relay();
+    test_stalled_pair();
+    if (failures) return 1;
+    printf("All scheduler tests passed\n");
+}
@@ -1,10 +1,69 @@
 #include "server.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s base_dir\n", argv[0]);
+    size_t upload_slots = default_upload_slots;
+    size_t download_slots = default_download_slots;
+    size_t seed_slots = default_upload_slots;
+    size_t io_threads = default_io_threads;
+    bool compress = false;
+    std::string manifest_dir;
+    address multicast_group;
+    address multicast_interface;
+    size_t multicast_rate = default_multicast_rate;
+    size_t max_relays = 0;
+    chunking_mode chunking = fixed_chunking;
+    size_t chunk_size = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "u:d:s:t:zm:M:I:r:c:Ck:")) != -1) {
+        switch (opt) {
+            case 'u':
+                upload_slots = atol(optarg);
+                break;
+            case 'd':
+                download_slots = atol(optarg);
+                break;
+            case 's':
+                seed_slots = atol(optarg);
+                break;
+            case 't':
+                io_threads = atol(optarg);
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'm':
+                manifest_dir = optarg;
+                break;
+            case 'M':
+                multicast_group = address::from_string(optarg);
+                break;
+            case 'I':
+                multicast_interface = address::from_string(optarg);
+                break;
+            case 'r':
+                multicast_rate = atol(optarg);
+                break;
+            case 'c':
+                max_relays = atol(optarg);
+                break;
+            case 'C':
+                chunking = content_defined_chunking;
+                break;
+            case 'k':
+                chunk_size = atol(optarg);
+                break;
+            default:
+                optind = argc;
+        }
+    }
+    if (argc - optind != 1 || !pick_chunking(chunking, chunk_size, 0).valid()) {
+        fprintf(stderr, "Usage: %s [-u upload_slots] [-d download_slots] [-s seed_slots] [-t io_threads] [-z] [-m manifest_dir] [-c max_relays] [-C] [-k chunk_size]\n"
+                        "          [-M multicast_group [-I multicast_interface] [-r multicast_rate_mbit]] base_dir\n", argv[0]);
         return 1;
     }
-    Server<>(argv[1]).run();
+    Server<>(argv[optind], upload_slots, download_slots, seed_slots, io_threads, compress, manifest_dir,
+             multicast_group, multicast_interface, multicast_rate, max_relays, chunking, chunk_size).run();
 }
@@ -0,0 +1,90 @@
+#include "thread_pool.h"
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+ThreadPool::ThreadPool(size_t threads): stopping(false) {
+    for (size_t i=0; i<threads; i++) {
+        workers.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& x: workers) x.join();
+}
+
+void ThreadPool::work() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] {return stopping || !tasks.empty();});
+            if (tasks.empty()) return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+void ThreadPool::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+namespace {
+struct ParallelFor {
+    std::atomic<size_t> next;
+    size_t count;
+    const std::function<void(size_t)>& fn;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running;
+    bool claimed;
+    ParallelFor(size_t count, const std::function<void(size_t)>& fn): next(0), count(count), fn(fn), running(0), claimed(false) {}
+    void run() {
+        for (size_t i = next++; i < count; i = next++) fn(i);
+    }
+};
+}
+
+// The calling thread takes part in the work. Helpers that only get to run
+// after every index has been claimed return without touching fn, so a
+// parallel_for issued from inside the pool cannot wait on itself.
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& fn) {
+    std::shared_ptr<ParallelFor> state = std::make_shared<ParallelFor>(count, fn);
+    size_t helpers = std::min(count, workers.size());
+    for (size_t i=1; i<helpers; i++) {
+        post([state] () {
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (state->claimed) return;
+                state->running++;
+            }
+            state->run();
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (--state->running == 0) state->cv.notify_all();
+        });
+    }
+    state->run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->claimed = true;
+    state->cv.wait(lock, [&state] {return state->running == 0;});
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
@@ -0,0 +1,140 @@
+#include "client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <boost/filesystem.hpp>
+
+class QuietUI {
+public:
+    QuietUI(const std::vector<std::string>& header_lines) {}
+    void report_client_status(const std::unordered_map<size_t, ClientStatus>& clients, const Scheduler& scheduler) {}
+    void report_status(const std::unordered_map<std::string, File>& files) {}
+    void log(const std::string& message) {}
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+static bool write_file(const std::string& path, const std::vector<uint8_t>& data) {
+    FILE* out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+    return fclose(out) == 0 && ok;
+}
+
+static bool read_file(const std::string& path, std::vector<uint8_t>& data) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+    std::vector<uint8_t> buffer(0x100000);
+    data.clear();
+    size_t n;
+    while ((n = fread(buffer.data(), 1, buffer.size(), in)) > 0) data.insert(data.end(), buffer.begin(), buffer.begin() + n);
+    fclose(in);
+    return true;
+}
+
+static pid_t start_server(const std::string& server, const std::string& chunk_size, const std::string& manifest_dir,
+                          const std::string& base_dir) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execl(server.c_str(), server.c_str(), "-k", chunk_size.c_str(), "-m", manifest_dir.c_str(), base_dir.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+// The server is done hashing when it starts to listen.
+static bool wait_for_server(pid_t pid) {
+    boost::asio::io_service io_service;
+    for (;;) {
+        if (waitpid(pid, nullptr, WNOHANG) != 0) return false;
+        tcp::socket socket(io_service);
+        boost::system::error_code ec;
+        socket.connect(tcp::endpoint(address::from_string("127.0.0.1"), server_port), ec);
+        if (!ec) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+// Runs the server binary built next to this one on a random image, and a
+// client in this process that fetches it over loopback, once per chunk size.
+// The time to hash the image and the time to transfer it both depend on how
+// many chunks it is cut into.
+int main(int argc, char** argv) {
+    size_t scale = 1;
+    if (argc == 2) {
+        scale = atol(argv[1]);
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [scale]\n", argv[0]);
+        return 1;
+    }
+    std::string self = argv[0];
+    std::string server = (self.find('/') == std::string::npos ? std::string(".") : self.substr(0, self.rfind('/'))) + "/server";
+
+    char dir_template[] = "/tmp/transfer_bench.XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+    std::string server_dir = dir + "/server";
+    mkdir(server_dir.c_str(), 0755);
+
+    std::vector<uint8_t> image(0x4000000 * scale);
+    std::mt19937_64 rng(scale);
+    for (size_t i=0; i+8<=image.size(); i+=8) {
+        uint64_t x = rng();
+        memcpy(&image[i], &x, 8);
+    }
+    if (!write_file(server_dir + "/image", image)) {
+        perror("write");
+        return 1;
+    }
+
+    const size_t sizes[] = {0, 0x10000, 0x40000, 0x100000, 0x400000, 0x1000000};
+    printf("%-12s %10s %10s %12s %10s\n", "chunk size", "chunks", "hash ms", "transfer ms", "MiB/s");
+    for (size_t chunk_size: sizes) {
+        std::string run = dir + "/" + std::to_string(chunk_size);
+        std::string client_dir = run + "/client";
+        mkdir(run.c_str(), 0755);
+        mkdir(client_dir.c_str(), 0755);
+
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = start_server(server, std::to_string(chunk_size), run + "/manifests", server_dir);
+        if (!wait_for_server(pid)) {
+            fprintf(stderr, "Could not start %s\n", server.c_str());
+            return 1;
+        }
+        double hash = elapsed_ms(start);
+
+        start = std::chrono::steady_clock::now();
+        Client<QuietUI>(address::from_string("127.0.0.1"), client_dir, {"image"}).run_until_complete();
+        double transfer = elapsed_ms(start);
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+
+        std::vector<uint8_t> received;
+        if (!read_file(client_dir + "/image", received) || received != image) {
+            fprintf(stderr, "Transfer with chunk size %zu did not give back the image\n", chunk_size);
+            return 1;
+        }
+        const Chunking& chunking = pick_chunking(fixed_chunking, chunk_size, image.size());
+        std::string name = chunk_size ? std::to_string(chunk_size / 1024) + "K" : "picked " + std::to_string(chunking.max_size / 1024) + "K";
+        printf("%-12s %10zu %10.1f %12.1f %10.1f\n", name.c_str(), cut_chunks(nullptr, image.size(), chunking).size(),
+            hash, transfer, image.size() / 1048576.0 / transfer * 1000);
+        boost::filesystem::remove_all(run);
+    }
+    boost::filesystem::remove_all(dir);
+}
@@ -21,10 +21,11 @@ void BasicUI::log(const std::string& message) {
     print_line(message, true);
 }
 
-void BasicUI::report_client_status(const std::unordered_map<address, ClientStatus>& clients) {
+void BasicUI::report_client_status(const std::unordered_map<size_t, ClientStatus>& clients, const Scheduler& scheduler) {
     size_t clients_done = 0;
     for (auto& x: clients) {
-        if (x.second.chunks_owned.size() == x.second.chunks_needed.size()) {
+        const PeerChunks& chunks = scheduler.get_peer(x.second.id);
+        if (chunks.owned.size() == chunks.needed.size()) {
             clients_done++;
         }
     }
@@ -68,13 +69,14 @@ void ANSIUI::write_ui() {
     }
 }
 
-void ANSIUI::report_client_status(const std::unordered_map<address, ClientStatus>& clients) {
+void ANSIUI::report_client_status(const std::unordered_map<size_t, ClientStatus>& clients, const Scheduler& scheduler) {
     clear_ui();
     std::vector<std::string> status;
     for (auto& x: clients) {
-        std::string address = x.first.to_string();
+        std::string address = x.second.addr.to_string();
         address.resize(40, ' ');
-        status.push_back(address + std::to_string(x.second.chunks_owned.size()) + " of " + std::to_string(x.second.chunks_needed.size()) + " chunks done");
+        const PeerChunks& chunks = scheduler.get_peer(x.second.id);
+        status.push_back(address + std::to_string(chunks.owned.size()) + " of " + std::to_string(chunks.needed.size()) + " chunks done");
     }
     this->status.swap(status);
     write_ui();